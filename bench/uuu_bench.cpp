@@ -0,0 +1,302 @@
+/*
+ * Copyright 2026 NXP.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * Neither the name of the NXP Semiconductor nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Drive the real protocol commands against the in-process device emulator
+ * and report throughput and per command latency of the host stack.
+ */
+
+#include "../libuuu/cmd.h"
+#include "../libuuu/config.h"
+#include "../libuuu/emulator.h"
+#include "../libuuu/libuuu.h"
+#include "../libuuu/trans.h"
+#include "../libuuu/transstats.h"
+#include "../libuuu/urb.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "libusb.h"
+}
+
+using namespace std;
+
+struct BenchCase
+{
+	const char *name;
+	const char *protocol;
+	string cmd;
+	uint64_t bytes;
+};
+
+static void print_usage()
+{
+	printf("uuu_bench [-bw MB/s] [-lat us] [-size MB] [-spl MB] [-n loops] [-urb depth] [-d dir]\n");
+	printf("uuu_bench -check\n");
+	printf("\t-bw\temulated bus bandwidth, 0 is unlimited, default 40\n");
+	printf("\t-lat\temulated round trip of one transfer, default 125\n");
+	printf("\t-size\tsize of the fastboot test image, default 64\n");
+	printf("\t-spl\tsize of the SDP/SDPS test image, default 8\n");
+	printf("\t-n\trun each command n times, report the best, default 3\n");
+	printf("\t-urb\tusb requests kept in flight, see uuu -urb\n");
+	printf("\t-d\tdirectory for the generated test images, default .\n");
+	printf("\t-check\trun the usb request queue against a software transport and exit\n");
+}
+
+static int check_fail(const char *name, const char *what)
+{
+	fprintf(stderr, "urb %s: %s\n", name, what);
+	return -1;
+}
+
+/* URBQueue::write() against SoftURBQueue: ordering, submit failure, usbfs memory shortage, cancel on error */
+static int check_urb()
+{
+	vector<uint8_t> data(0x100000);
+	mt19937 rnd(0x5eed);
+	for (auto &v : data)
+		v = (uint8_t)rnd();
+
+	int ret = 0;
+	{
+		SoftURBQueue q(4, 200);
+		auto stats = make_shared<TransStats>("check");
+		q.set_stats(stats);
+		uuu_usb_stats s;
+		if (q.write(data.data(), data.size(), 0x10000))
+			ret = check_fail("in order", "write failed");
+		else if (q.m_data != data)
+			ret = check_fail("in order", "data out of order");
+		else if (q.m_max_inflight < 2 || q.m_max_inflight > 4)
+			ret = check_fail("in order", "wrong number of requests in flight");
+		else if (stats->get(s), s.transfers != data.size() / 0x10000 || s.bytes != data.size())
+			ret = check_fail("in order", "requests not recorded one by one");
+	}
+	{
+		SoftURBQueue q(4, 1000);
+		q.m_fail_submit = 6;
+		if (q.write(data.data(), data.size(), 0x10000) != LIBUSB_ERROR_IO)
+			ret = check_fail("submit error", "error not returned");
+		else if (q.m_submitted != 7)
+			ret = check_fail("submit error", "kept submitting after the error");
+		else if (!q.m_cancelled)
+			ret = check_fail("submit error", "requests in flight not cancelled");
+
+		q.m_fail_submit = SIZE_MAX;
+		q.m_data.clear();
+		if (q.write(data.data(), data.size(), 0x10000) || q.m_data != data)
+			ret = check_fail("submit error", "queue not usable after the error");
+	}
+	{
+		SoftURBQueue q(4, 200);
+		q.m_mem_limit = 2;
+		if (q.write(data.data(), data.size(), 0x10000))
+			ret = check_fail("no memory", "write failed");
+		else if (q.m_data != data)
+			ret = check_fail("no memory", "data out of order");
+		else if (q.m_max_inflight != 2)
+			ret = check_fail("no memory", "wrong number of requests in flight");
+
+		size_t sent = SIZE_MAX;
+		q.m_mem_limit = 0;
+		if (q.write(data.data(), data.size(), 0x10000, &sent) != LIBUSB_ERROR_NO_MEM || sent)
+			ret = check_fail("no memory", "error not returned");
+	}
+	{
+		SoftURBQueue q(4, 1000);
+		q.m_fail_complete = 2;
+		if (q.write(data.data(), data.size(), 0x10000) != LIBUSB_ERROR_IO)
+			ret = check_fail("complete error", "error not returned");
+		else if (q.m_submitted > 2 + q.depth())
+			ret = check_fail("complete error", "kept submitting after the error");
+		else if (!q.m_cancelled)
+			ret = check_fail("complete error", "requests in flight not cancelled");
+		else if (q.m_data.size() >= data.size() || !equal(q.m_data.begin(), q.m_data.end(), data.begin()))
+			ret = check_fail("complete error", "data after the error transferred");
+	}
+
+	printf("urb check %s\n", ret ? "failed" : "passed");
+	return ret;
+}
+
+/* half random, half zero blocks, so raw2sparse has something to skip */
+static int gen_file(const string &name, uint64_t size, bool holes)
+{
+	ofstream f(name, ios::binary | ios::trunc);
+	if (!f)
+	{
+		fprintf(stderr, "Fail to create %s\n", name.c_str());
+		return -1;
+	}
+
+	mt19937 rnd(0x5eed);
+	vector<uint32_t> blk(0x10000 / sizeof(uint32_t));
+	for (uint64_t off = 0; off < size; off += 0x10000)
+	{
+		bool zero = holes && (rnd() & 1);
+		for (auto &v : blk)
+			v = zero ? 0 : rnd();
+
+		size_t sz = min<uint64_t>(size - off, 0x10000);
+		f.write((const char *)blk.data(), sz);
+	}
+	return f ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	double bw = 40;
+	unsigned int lat = 125;
+	uint64_t size = 64;
+	uint64_t spl = 8;
+	int loops = 3;
+	string dir = ".";
+
+	for (int i = 1; i < argc; i++)
+	{
+		string s = argv[i];
+		if (s == "-check")
+			return check_urb();
+
+		if (i + 1 >= argc)
+		{
+			print_usage();
+			return -1;
+		}
+
+		if (s == "-bw")
+			bw = atof(argv[++i]);
+		else if (s == "-lat")
+			lat = atoi(argv[++i]);
+		else if (s == "-size")
+			size = strtoull(argv[++i], nullptr, 0);
+		else if (s == "-spl")
+			spl = strtoull(argv[++i], nullptr, 0);
+		else if (s == "-n")
+			loops = max(1, atoi(argv[++i]));
+		else if (s == "-urb")
+			uuu_set_urb_depth(atoi(argv[++i]));
+		else if (s == "-d")
+			dir = argv[++i];
+		else
+		{
+			print_usage();
+			return -1;
+		}
+	}
+
+	size <<= 20;
+	spl <<= 20;
+
+	string img = dir + "/uuu_bench.img";
+	string boot = dir + "/uuu_bench_spl.bin";
+	string out = dir + "/uuu_bench_upload.bin";
+
+	if (gen_file(img, size, true) || gen_file(boot, spl, false))
+		return -1;
+
+	EmuDevice emu;
+	emu.m_bandwidth = (uint64_t)(bw * 1000000);
+	emu.m_latency_us = lat;
+
+	set_trans_factory(emu_create_trans);
+
+	ConfigItem item("SDPS:", "MX8QXP", nullptr, 0x1fc9, 0x012f);
+	CmdCtx ctx;
+	ctx.m_dev = &emu;
+	ctx.m_config_item = &item;
+
+	vector<BenchCase> cases = {
+		{ "fastboot command", "FB", "FB: ucmd setenv bench 1", 0 },
+		{ "getvar", "FB", "FB: getvar max-download-size", 0 },
+		{ "download", "FB", "FB: download -f " + img, size },
+		{ "upload", "FB", "FB: upload -f " + out, size },
+		{ "flash", "FB", "FB: flash bench " + img, size },
+		{ "flash -raw2sparse", "FB", "FB: flash -raw2sparse bench " + img, size },
+		{ "write", "FB", "FB: write -f " + img, size },
+		{ "crc", "FB", "FB: crc -f " + img, size },
+		{ "ucp to target", "FBK", "FBK: ucp " + boot + " t:/tmp/bench", spl },
+		{ "ucp from target", "FBK", "FBK: ucp t:/tmp/bench " + out, spl },
+		{ "sdp write", "SDP", "SDP: write -f " + boot + " -addr 0x80000000", spl },
+		{ "sdps boot", "SDPS", "SDPS: boot -f " + boot, spl },
+	};
+
+	printf("bus: %.1f MB/s, %u us per transfer, %d loops\n\n", bw, lat, loops);
+	printf("%-20s %12s %10s %10s %10s\n", "command", "bytes", "best ms", "avg ms", "MB/s");
+
+	int ret = 0;
+	for (auto &c : cases)
+	{
+		double best = 0, total = 0;
+		uint64_t transfers = emu.m_transfers;
+
+		int i;
+		for (i = 0; i < loops; i++)
+		{
+			auto start = chrono::steady_clock::now();
+			if (run_cmd(&ctx, c.cmd.c_str(), 0))
+			{
+				fprintf(stderr, "%s failed: %s\n", c.name, uuu_get_last_err_string());
+				ret = -1;
+				break;
+			}
+			double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+			best = i ? min(best, ms) : ms;
+			total += ms;
+		}
+
+		if (i < loops)
+			continue;
+
+		printf("%-20s %12llu %10.3f %10.3f", c.name, (unsigned long long)c.bytes, best, total / loops);
+		if (c.bytes)
+			printf(" %10.2f", c.bytes / best / 1000.0);
+		else
+			printf(" %10s", "-");
+		printf("   (%llu transfers)\n", (unsigned long long)(emu.m_transfers - transfers) / loops);
+	}
+
+	remove(img.c_str());
+	remove(boot.c_str());
+	remove(out.c_str());
+
+	return ret;
+}
@@ -84,13 +84,20 @@ int DataBuffer:: resize(size_t sz)
 
 	if (sz > m_MemSize)
 	{
-		m_pDatabuffer = (uint8_t*)realloc(m_pDatabuffer, sz);
-		if (!m_pDatabuffer)
+		size_t cap;
+		uint8_t *p = (uint8_t*)BufferPool::alloc(sz, &cap);
+		if (!p)
 		{
 			set_last_err_string("fail alloc memory");
 			return -1;
 		}
-		m_MemSize = sz;
+		if (m_pDatabuffer)
+		{
+			memcpy(p, m_pDatabuffer, m_DataSize);
+			BufferPool::free(m_pDatabuffer, m_MemSize);
+		}
+		m_pDatabuffer = p;
+		m_MemSize = cap;
 	}
 
 	m_DataSize = sz;
@@ -242,7 +249,7 @@ public:
 		p->m_available_size = st.st_size;
 
 		atomic_fetch_or(&p->m_dataflags, FILEBUFFER_FLAG_LOADED | FILEBUFFER_FLAG_NEVER_FREE);
-		p->m_request_cv.notify_all();
+		p->notify_request();
 
 		return 0;
 	}
@@ -390,11 +397,11 @@ int FSHttp::http_load(shared_ptr<HttpStream> http, shared_ptr<FileBuffer> p, str
 		if (http->HttpDownload((char*)(p->data() + i), sz) < 0)
 		{
 			atomic_fetch_or(&p->m_dataflags, FILEBUFFER_FLAG_ERROR_BIT);
-			p->m_request_cv.notify_all();
+			p->notify_request();
 			return -1;
 		}
 		p->m_available_size = i + sz;
-		p->m_request_cv.notify_all();
+		p->notify_request();
 
 		ut.type = uuu_notify::NOTIFY_TRANS_POS;
 		ut.total = i + sz;
@@ -402,7 +409,7 @@ int FSHttp::http_load(shared_ptr<HttpStream> http, shared_ptr<FileBuffer> p, str
 	}
 
 	atomic_fetch_or(&p->m_dataflags, FILEBUFFER_FLAG_LOADED | FILEBUFFER_FLAG_NEVER_FREE);
-	p->m_request_cv.notify_all();
+	p->notify_request();
 
 	ut.type = uuu_notify::NOTIFY_DOWNLOAD_END;
 	ut.str = (char*)filename.c_str();
@@ -535,7 +542,7 @@ public:
 	}
 	virtual ~Gzstream()
 	{
-		deflateEnd(&m_strm);
+		inflateEnd(&m_strm);
 	}
 	virtual int set_input_buff(void* p, size_t sz) override
 	{
@@ -787,7 +794,7 @@ int zip_async_load(string zipfile, string fn, shared_ptr<FileBuffer> buff)
 	buff->m_available_size = buff->m_DataSize;
 	atomic_fetch_or(&buff->m_dataflags, FILEBUFFER_FLAG_LOADED);
 
-	buff->m_request_cv.notify_all();
+	buff->notify_request();
 	return 0;
 }
 
@@ -805,7 +812,7 @@ int FSZip::load(const string &backfile, const string &filename, shared_ptr<FileB
 		return -1;
 
 	atomic_fetch_or(&p->m_dataflags, FILEBUFFER_FLAG_LOADED);
-	p->m_request_cv.notify_all();
+	p->notify_request();
 
 	return 0;
 }
@@ -854,7 +861,7 @@ int FSTar::load(const string &backfile, const string &filename, shared_ptr<FileB
 		return -1;
 	p->m_available_size = p->m_DataSize;
 	atomic_fetch_or(&p->m_dataflags, FILEBUFFER_FLAG_LOADED);
-	p->m_request_cv.notify_all();
+	p->notify_request();
 	return 0;
 }
 
@@ -880,7 +887,7 @@ int FSFat::load(const string &backfile, const string &filename, shared_ptr<FileB
 		return -1;
 
 	atomic_fetch_or(&p->m_dataflags, FILEBUFFER_FLAG_LOADED);
-	p->m_request_cv.notify_all();
+	p->notify_request();
 
 	return 0;
 }
@@ -1059,6 +1066,7 @@ int FSCompressStream::Decompress(const string& backfile, shared_ptr<FileBuffer>o
 	{
 		outp->resize(sz);
 		atomic_fetch_or(&outp->m_dataflags, FILEBUFFER_FLAG_KNOWN_SIZE);
+		outp->notify_request();
 	}
 
 	std::shared_ptr<DataBuffer> buff;
@@ -1077,10 +1085,7 @@ int FSCompressStream::Decompress(const string& backfile, shared_ptr<FileBuffer>o
 	if (!blk)
 		blk = outp->request_new_blk();
 
-	{
-		lock_guard<mutex> l(outp->m_seg_map_mutex);
-		outp->m_last_db = blk;
-	}
+	outp->m_last_db_offset = blk->m_output_offset;
 
 	cs->set_output_buff(blk->data(), blk->m_output_size);
 
@@ -1113,7 +1118,8 @@ int FSCompressStream::Decompress(const string& backfile, shared_ptr<FileBuffer>o
 			if (ret < 0) {
 				blk->m_ret = ret;
 				set_last_err_string("decompress error");
-				outp->m_request_cv.notify_all();
+				blk->notify();
+				outp->notify_request();
 				return -1;
 			}
 
@@ -1126,24 +1132,30 @@ int FSCompressStream::Decompress(const string& backfile, shared_ptr<FileBuffer>o
 			ut.index = outOffset;
 			call_notify(ut);
 			outp->m_available_size = outOffset;
-			outp->m_request_cv.notify_all();
 
+			/* segment readers wait on their block, the others on the whole file */
+			if (cs->get_output_pos() == blk->m_output_size)
+				atomic_fetch_or(&blk->m_dataflags, (int)FragmentBlock::CONVERT_DONE);
+			blk->notify();
+			if (outp->get_m_allocate_way() != FileBuffer::ALLOCATION_WAYS::SEGMENT)
+				outp->notify_request();
 
 			if (cs->get_output_pos() == blk->m_output_size)
 			{
-				atomic_fetch_or(&blk->m_dataflags, (int)FragmentBlock::CONVERT_DONE);
 				if (!(cs->get_input_pos() == buff->size() &&
 					buff->size() == (inp->size() - offset)))
 				{
+					if (outp->wait_pool(blk->m_output_offset))
+						return -1;
+
 					blk = outp->get_map_it(outOffset, true);
 					if(!blk)
 						blk = outp->request_new_blk();
+					if (!blk)
+						return -1;
 					cs->set_output_buff(blk->data(), blk->m_output_size);
 
-					{
-						lock_guard<mutex> l(outp->m_seg_map_mutex);
-						outp->m_last_db = blk;
-					}
+					outp->m_last_db_offset = blk->m_output_offset;
 				}
 			}
 
@@ -1161,7 +1173,8 @@ int FSCompressStream::Decompress(const string& backfile, shared_ptr<FileBuffer>o
 	atomic_fetch_or(&blk->m_dataflags, (int)FragmentBlock::CONVERT_DONE);
 	atomic_fetch_or(&outp->m_dataflags, FILEBUFFER_FLAG_LOADED);
 
-	outp->m_request_cv.notify_all();
+	blk->notify();
+	outp->notify_request();
 	if (lastRet < 0)
 		return -1;
 	return 0;
@@ -1280,6 +1293,10 @@ FileBuffer::~FileBuffer()
 		if(m_allocate_way == ALLOCATION_WAYS::MALLOC)
 			free(m_pDatabuffer);
 	}
+
+	/* the segments of this file go to the pool, which needn't keep them all */
+	m_seg_table.clear();
+	BufferPool::trim();
 }
 
 int FileBuffer::mapfile(const string &filename, size_t sz)
@@ -1418,22 +1435,59 @@ int FileBuffer::request_data(std::vector<uint8_t> &data, size_t offset, size_t s
 	return 0;
 }
 
+int SegmentTable::set(size_t index, shared_ptr<FragmentBlock> blk)
+{
+	if (index >= PAGE_SIZE * PAGE_NUM)
+	{
+		set_last_err_string("too many segments in file buffer");
+		return -1;
+	}
+
+	lock_guard<mutex> lock(m_mutex);
+
+	Page *page = m_pages[index >> PAGE_SHIFT].load(std::memory_order_relaxed);
+	if (!page)
+	{
+		page = new Page;
+		m_pages[index >> PAGE_SHIFT].store(page, std::memory_order_release);
+	}
+
+	/* published slots are never rewritten, lookups may be copying them */
+	Slot &slot = page->slot[index & (PAGE_SIZE - 1)];
+	if (slot.ready.load(std::memory_order_relaxed))
+		return 0;
+
+	slot.blk = blk;
+	slot.ready.store(true, std::memory_order_release);
+
+	if (m_size.load(std::memory_order_relaxed) <= index)
+		m_size.store(index + 1, std::memory_order_release);
+
+	return 0;
+}
+
 void FileBuffer::truncate_old_data_in_pool()
 {
 	if (!g_small_memory)
 		return;
 
-
-	std::unique_lock<std::mutex> lock(this->m_seg_map_mutex);
-
-	if (m_last_request_offset < m_total_buffer_size/2)
+	size_t last = m_last_request_offset;
+	if (last < m_total_buffer_size/2)
 		return;
 
-	size_t off = m_last_request_offset - m_total_buffer_size/2;
+	truncate_data_before(last - m_total_buffer_size/2);
+}
+
+void FileBuffer::truncate_data_before(size_t off)
+{
+	size_t end = get_seg_index(off);
 
-	for (auto it= m_seg_map.lower_bound(off); it != m_seg_map.end(); it++)
+	for (size_t i = 0; i <= end; i++)
 	{
-		auto blk = it->second;
+		auto blk = m_seg_table.at(i);
+		if (!blk || blk->m_output_offset > off)
+			continue;
+
 		std::unique_lock<std::mutex> lock(blk->m_mutex);
 
 		if ((blk->m_dataflags & FragmentBlock::CONVERT_DONE)
@@ -1442,8 +1496,9 @@ void FileBuffer::truncate_old_data_in_pool()
 		{
 			blk->m_dataflags = 0;
 			blk->m_actual_size = 0;
-			vector<uint8_t> v;
+			decltype(blk->m_data) v;
 			blk->m_data.swap(v);
+			blk->m_cv.notify_all();
 		}
 	}
 }
@@ -1454,30 +1509,28 @@ int64_t FileBuffer::request_data_from_segment(void *data, size_t offset, size_t
 
 	do
 	{
-		m_last_request_offset = offset;
-		std::unique_lock<std::mutex> lck(m_request_cv_mutex);
+		{
+			/* the loader checks it in wait_pool() with the lock held, so it can't miss the wake up */
+			std::lock_guard<std::mutex> lck(m_pool_load_cv_mutex);
+			m_last_request_offset = offset;
+			m_pool_load_cv.notify_all();
+		}
 
 		shared_ptr<FragmentBlock> blk;
 
-		m_pool_load_cv.notify_all();
-
-		while (!(blk = get_map_it(offset)))
 		{
-			if (IsKnownSize())
-			{
-				if(offset >= this->m_DataSize)
-					return -1;
-			}
-			auto now = std::chrono::system_clock::now();
-			m_request_cv.wait_until(lck, now + 500ms);
+			/* woken by notify_request() when a block is published or the size is known */
+			std::unique_lock<std::mutex> lck(m_request_cv_mutex);
+			m_request_cv.wait(lck, [&] {
+				return (blk = get_map_it(offset)) || (IsKnownSize() && offset >= m_DataSize);
+			});
 		}
+		if (!blk)
+			return -1;
+
 		do
 		{
-			shared_ptr<FragmentBlock> last_decompress_db;
-			{
-				std::unique_lock<std::mutex> lock(m_seg_map_mutex);
-				last_decompress_db = m_last_db;
-			}
+			size_t last_decompress_offset = m_last_db_offset;
 
 			{   /*lock hold*/
 				std::unique_lock<std::mutex> lock(blk->m_mutex);
@@ -1487,13 +1540,10 @@ int64_t FileBuffer::request_data_from_segment(void *data, size_t offset, size_t
 
 				if (!(m_dataflags & FILEBUFFER_FLAG_PARTIAL_RELOADABLE))
 				{
-					if (last_decompress_db)
+					if (offset < last_decompress_offset && !(blk->m_dataflags & FragmentBlock::CONVERT_DONE))
 					{
-						if (offset < last_decompress_db->m_output_offset && !(blk->m_dataflags & FragmentBlock::CONVERT_DONE))
-						{
-							m_reset_stream = true;
-							break;
-						}
+						m_reset_stream = true;
+						break;
 					}
 				}
 
@@ -1505,17 +1555,20 @@ int64_t FileBuffer::request_data_from_segment(void *data, size_t offset, size_t
 					atomic_fetch_or(&blk->m_dataflags, (int)FragmentBlock::USING);
 					break;
 				}
+
+				/* the decompressor calls blk->notify() on every progress of this block */
+				blk->m_cv.wait(lock);
 			}
-			auto now = std::chrono::system_clock::now();
-			m_request_cv.wait_until(lck, now + 500ms);
 		} while (1);
 
 		if (m_reset_stream)
 		{
-			m_dataflags = 0;
+			/* the size doesn't change by decompressing again */
+			m_dataflags &= FILEBUFFER_FLAG_KNOWN_SIZE_BIT;
 			m_available_size = 0;
 			this->m_async_thread.join();
 			m_reset_stream = false;
+			m_last_db_offset = 0;
 
 			this->reload(m_filename, true);
 			continue;
@@ -1625,47 +1678,57 @@ int64_t FileBuffer::request_data(void *data, size_t offset, size_t sz)
 	return ret;
 }
 
+/*
+ * Called by the stream loader before it fills the block after offset. In small
+ * memory mode it waits until the reader is close enough. A reader waiting in
+ * size() reads nothing until the loader reaches the end, so then the loader
+ * keeps going and drops the oldest blocks. The reader finds them gone and
+ * restarts the stream, see request_data_from_segment().
+ */
+int FileBuffer::wait_pool(size_t offset)
+{
+	if (m_allocate_way != ALLOCATION_WAYS::SEGMENT || !g_small_memory)
+		return 0;
+
+	truncate_old_data_in_pool();
+
+	std::unique_lock<std::mutex> lck(m_pool_load_cv_mutex);
+	while (offset > m_last_request_offset + m_total_buffer_size)
+	{
+		if (m_reset_stream)
+			return -1;
+
+		if (m_size_waiters)
+		{
+			lck.unlock();
+			truncate_data_before(offset - m_total_buffer_size);
+			return 0;
+		}
+
+		m_pool_load_cv.wait(lck);
+	}
+
+	return 0;
+}
+
 std::shared_ptr<FragmentBlock> FileBuffer::request_new_blk()
 {
 	if (m_allocate_way == ALLOCATION_WAYS::SEGMENT)
 	{
-		if (m_seg_map.empty())
+		if (!m_seg_table.size())
 		{
 			std::shared_ptr<FragmentBlock> p(new FragmentBlock);
-			lock_guard<mutex> lock(m_seg_map_mutex);
 			p->m_output_size = m_seg_blk_size;
 			p->m_data.resize(m_seg_blk_size);
-			m_seg_map[0] = p;
+			if (m_seg_table.set(0, p))
+				return NULL;
+			notify_request();
 			return p;
 		}
 		
 		size_t offset;
 
-		if (g_small_memory)
-		{
-			truncate_old_data_in_pool();
-
-			{
-				lock_guard<mutex> lock(m_seg_map_mutex);
-				shared_ptr <FragmentBlock> p = m_seg_map.begin()->second;
-				offset = p->m_output_offset;
-			}
-
-			while (offset > m_last_request_offset + m_total_buffer_size)
-			{
-				if (m_reset_stream)
-					return NULL;
-				std::unique_lock<std::mutex> lck(m_pool_load_cv_mutex);
-				m_pool_load_cv.wait(lck);
-			}
-		}
-
-		{
-			lock_guard<mutex> lock(m_seg_map_mutex);
-			shared_ptr <FragmentBlock> p = m_seg_map.begin()->second;
-			offset = p->m_output_offset;
-		}
-
+		offset = m_seg_table.back()->m_output_offset;
 		offset += m_seg_blk_size;
 
 		std::shared_ptr<FragmentBlock> p(new FragmentBlock);
@@ -1673,10 +1736,9 @@ std::shared_ptr<FragmentBlock> FileBuffer::request_new_blk()
 		p->m_output_offset = offset;
 		p->m_data.resize(m_seg_blk_size);
 
-		{
-			lock_guard<mutex> lock(m_seg_map_mutex);
-			m_seg_map[offset] = p;
-		}
+		if (m_seg_table.set(offset / m_seg_blk_size, p))
+			return NULL;
+		notify_request();
 
 		return p;
 	}
@@ -1691,7 +1753,8 @@ std::shared_ptr<FragmentBlock> FileBuffer::request_new_blk()
 
 std::shared_ptr<DataBuffer> FileBuffer::request_data(size_t offset, size_t sz)
 {
-	shared_ptr<DataBuffer> p(new DataBuffer);
+	/* object and control block come from the pool in one piece */
+	shared_ptr<DataBuffer> p = allocate_shared<DataBuffer>(PoolAllocator<DataBuffer>());
 
 	if (IsLoaded() && IsRefable())
 	{
@@ -1908,17 +1971,20 @@ int FSCompressStream::load(const string& backfile, const string& filename, share
 			threads.push_back(thread(&FSCompressStream::PreloadWorkThread, this, outp));
 		}
 
+		size_t index = 0;
+
+		/* compressed blocks have different sizes, look them up by offset */
+		outp->m_seg_variable = true;
+
 		while ((p = ScanCompressblock(backfile, offset, decompress_off)))
 		{
 			if (!p)
 				return 0;
 
-			{
-				lock_guard<mutex> lock(outp->m_seg_map_mutex);
-				outp->m_seg_map[p->m_output_offset] = p;
-			}
+			if (outp->m_seg_table.set(index++, p))
+				return -1;
 
-			outp->m_request_cv.notify_all();
+			outp->notify_request();
 			outp->m_pool_load_cv.notify_all();
 
 			total_size = p->m_output_offset + p->m_output_size;
@@ -1930,7 +1996,7 @@ int FSCompressStream::load(const string& backfile, const string& filename, share
 		outp->m_DataSize = total_size;
 
 		atomic_fetch_or(&outp->m_dataflags, FILEBUFFER_FLAG_KNOWN_SIZE | FILEBUFFER_FLAG_SEG_DONE);
-		outp->m_request_cv.notify_one();
+		outp->notify_request();
 
 		for (int i = 0; i < nthread; i++)
 		{
@@ -1959,31 +2025,27 @@ int FSBasic::PreloadWorkThread(shared_ptr<FileBuffer>outp)
 		shared_ptr<FragmentBlock> blk;
 
 		{
-			lock_guard<mutex> lock(outp->m_seg_map_mutex);
-
-			auto low = outp->m_seg_map.begin();
-
-			low = outp->m_seg_map.lower_bound(request_offset);
+			size_t i = outp->get_seg_index(request_offset);
+			size_t n = outp->m_seg_table.size();
 
 			int count = 0;
-			while (low != outp->m_seg_map.end() )
+			for (; i < n; i++)
 			{
-				if (!(low->second->m_dataflags & (FragmentBlock::CONVERT_START)))
+				auto low = outp->m_seg_table.at(i);
+				if (!low)
+					break;
+
+				/* claim the first block no other worker started */
+				if (!(atomic_fetch_or(&low->m_dataflags, (int)FragmentBlock::CONVERT_START) & FragmentBlock::CONVERT_START))
+				{
+					blk = low;
 					break;
+				}
 
-				low--;
 				count++;
 				if (g_small_memory && count >= 5)
 					break;
 			}
-
-			if (low != outp->m_seg_map.end()) {
-				if (!(low->second->m_dataflags & FragmentBlock::CONVERT_START))
-				{
-					atomic_fetch_or(&low->second->m_dataflags, (int)FragmentBlock::CONVERT_START);
-					blk = low->second;
-				}
-			}
 		}
 
 		if (!blk ||
@@ -2000,11 +2062,12 @@ int FSBasic::PreloadWorkThread(shared_ptr<FileBuffer>outp)
 		if (blk->DataConvert() < 0)
 		{
 				// todo error handle;
+				blk->notify();
 				continue;
 		}
 
 		atomic_fetch_or(&blk->m_dataflags, (int)FragmentBlock::CONVERT_DONE);
-		outp->m_request_cv.notify_all();
+		blk->notify();
 	}
 	return 0;
 }
@@ -2021,7 +2084,7 @@ int FSHttp::load(const string& backfile, const string& filename, shared_ptr<File
 	p->resize(sz);
 
 	atomic_fetch_or(&p->m_dataflags, FILEBUFFER_FLAG_KNOWN_SIZE);
-	p->m_request_cv.notify_all();
+	p->notify_request();
 
 	return http_load(http, p, backfile);
 }
@@ -2029,6 +2092,7 @@ int FSHttp::load(const string& backfile, const string& filename, shared_ptr<File
 void uuu_set_small_mem(uint32_t val)
 {
 	g_small_memory = !!val;
+	BufferPool::set_small_memory(g_small_memory);
 }
 
 void clean_up_filemap()
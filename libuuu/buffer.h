@@ -41,6 +41,7 @@
 #include <map>
 #include <queue>
 #include "liberror.h"
+#include "bufpool.h"
 #include <cstring>
 #ifdef _MSC_VER
 #include <Windows.h>
@@ -92,8 +93,9 @@ public:
 	size_t m_output_size = 0;
 	size_t m_output_offset = 0;
 	virtual int DataConvert() { return -1; };
-	std::vector<uint8_t> m_data;
+	std::vector<uint8_t, PoolAllocator<uint8_t>> m_data;
 	std::mutex m_mutex;
+	std::condition_variable m_cv;	/* waits for this block, with m_mutex */
 	std::atomic_int m_dataflags{0};
 	uint8_t* m_pData = NULL;
 	uint8_t* data()
@@ -103,9 +105,88 @@ public:
 		return m_data.data();
 	}
 
+	/* wake the readers of this block after its data or flags changed */
+	void notify()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+		}
+		m_cv.notify_all();
+	}
+
 	virtual ~FragmentBlock() {}
 };
 
+/*
+ * Segments of a FileBuffer indexed by their position. A slot is written once
+ * under m_mutex and published by a release store, so lookups take no lock.
+ * Slots are grouped in pages that are only allocated when first used.
+ */
+class SegmentTable
+{
+public:
+	enum
+	{
+		PAGE_SHIFT = 10,
+		PAGE_SIZE = 1 << PAGE_SHIFT,
+		PAGE_NUM = 512,
+	};
+
+	SegmentTable()
+	{
+		for (auto &p : m_pages)
+			p.store(nullptr, std::memory_order_relaxed);
+	}
+	~SegmentTable()
+	{
+		clear();
+	}
+
+	std::shared_ptr<FragmentBlock> at(size_t index) const
+	{
+		if (index >= PAGE_SIZE * PAGE_NUM)
+			return nullptr;
+
+		Page *page = m_pages[index >> PAGE_SHIFT].load(std::memory_order_acquire);
+		if (!page)
+			return nullptr;
+
+		const Slot &slot = page->slot[index & (PAGE_SIZE - 1)];
+		if (!slot.ready.load(std::memory_order_acquire))
+			return nullptr;
+
+		return slot.blk;
+	}
+
+	/* one past the highest published index */
+	size_t size() const { return m_size.load(std::memory_order_acquire); }
+	std::shared_ptr<FragmentBlock> back() const { size_t n = size(); return n ? at(n - 1) : nullptr; }
+
+	int set(size_t index, std::shared_ptr<FragmentBlock> blk);
+	/* drop all segments, nobody may look them up any more */
+	void clear()
+	{
+		for (auto &p : m_pages)
+			delete p.exchange(nullptr, std::memory_order_relaxed);
+		m_size.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	struct Slot
+	{
+		std::shared_ptr<FragmentBlock> blk;
+		std::atomic_bool ready { false };
+	};
+	struct Page
+	{
+		Slot slot[PAGE_SIZE];
+	};
+
+	std::atomic<Page*> m_pages[PAGE_NUM];
+	std::atomic_size_t m_size { 0 };
+	std::mutex m_mutex;
+};
+
 
 class DataBuffer : public std::enable_shared_from_this<DataBuffer>
 {
@@ -154,7 +235,7 @@ public:
 	{
 		if (m_allocate_way == ALLOCATION_WAYS::MALLOC)
 		{
-			free(m_pDatabuffer);
+			BufferPool::free(m_pDatabuffer, m_MemSize);
 		}
 	}
 	friend class FileBuffer;
@@ -196,19 +277,23 @@ public:
 
 	std::mutex m_async_mutex;
 
-	std::map<size_t, std::shared_ptr<FragmentBlock>, std::greater<size_t>> m_seg_map;
+	/* indexed by offset / m_seg_blk_size, or in offset order if m_seg_variable */
+	SegmentTable m_seg_table;
+	std::atomic_bool m_seg_variable { false };
 	std::mutex m_seg_map_mutex;
 	std::queue<size_t> m_offset_request;
-	size_t m_last_request_offset = 0;
+	std::atomic_size_t m_last_request_offset { 0 };	/* set with m_pool_load_cv_mutex held */
 	std::condition_variable m_pool_load_cv;
 	std::mutex m_pool_load_cv_mutex;
-	std::shared_ptr<FragmentBlock> m_last_db;
+	std::atomic_size_t m_last_db_offset { 0 };	/* block the stream decompressor is filling */
 	size_t m_seg_blk_size = 0x800000;
 	size_t m_total_buffer_size = 8 * m_seg_blk_size;
 	std::atomic_bool m_reset_stream { false };
+	std::atomic_int m_size_waiters { 0 };
 
 	//used for continue decompress\loading only
 	std::shared_ptr<FragmentBlock> request_new_blk();
+	int wait_pool(size_t offset);
 	bool check_offset_in_seg(size_t offset, std::shared_ptr<FragmentBlock> blk)
 	{
 		if (offset >= blk->m_output_offset
@@ -217,28 +302,39 @@ public:
 
 		return false;
 	}
-	std::shared_ptr<FragmentBlock> get_map_it(size_t offset, bool alloc = false)
+	size_t get_seg_index(size_t offset)
 	{
+		if (!m_seg_variable)
+			return offset / m_seg_blk_size;
+
+		/* last block starting at or before offset */
+		size_t lo = 0, hi = m_seg_table.size();
+		while (lo < hi)
 		{
-			std::lock_guard<std::mutex> lock(m_seg_map_mutex);
-			auto it = m_seg_map.lower_bound(offset);
-			if ( it == m_seg_map.end())
-				return NULL;
-
-			auto blk = it->second;
-			if (check_offset_in_seg(offset, blk))
-			{
-				if (alloc)
-				{
-					std::lock_guard<std::mutex> lck(blk->m_mutex);
-					blk->m_data.resize(blk->m_output_size);
-				}
-				return blk;
-			}
+			size_t mid = lo + (hi - lo) / 2;
+			auto blk = m_seg_table.at(mid);
+			if (blk && blk->m_output_offset <= offset)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo ? lo - 1 : 0;
+	}
+	std::shared_ptr<FragmentBlock> get_map_it(size_t offset, bool alloc = false)
+	{
+		auto blk = m_seg_table.at(get_seg_index(offset));
+		if (!blk || !check_offset_in_seg(offset, blk))
 			return NULL;
+
+		if (alloc)
+		{
+			std::lock_guard<std::mutex> lck(blk->m_mutex);
+			blk->m_data.resize(blk->m_output_size);
 		}
+		return blk;
 	}
 	void truncate_old_data_in_pool();
+	void truncate_data_before(size_t off);
 
 	std::atomic_int m_dataflags;
 
@@ -248,6 +344,15 @@ public:
 	std::condition_variable m_request_cv;
 	std::mutex m_request_cv_mutex;
 
+	/* wake the waiters of m_request_cv after the flags, size or segment table changed */
+	void notify_request()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_request_cv_mutex);
+		}
+		m_request_cv.notify_all();
+	}
+
 #ifdef WIN32
 	OVERLAPPED m_OverLapped;
 	REQUEST_OPLOCK_INPUT_BUFFER m_Request;
@@ -296,9 +401,18 @@ public:
 			return m_DataSize;
 
 		std::unique_lock<std::mutex> lck(m_request_cv_mutex);
+
+		/* let a throttled loader run ahead, see wait_pool() */
+		m_size_waiters++;
+		{
+			std::lock_guard<std::mutex> lock(m_pool_load_cv_mutex);
+		}
+		m_pool_load_cv.notify_all();
+
 		while (!(m_dataflags & FILEBUFFER_FLAG_KNOWN_SIZE_BIT))
 			m_request_cv.wait(lck);
 
+		m_size_waiters--;
 		return m_DataSize;
 	}
 
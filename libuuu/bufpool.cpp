@@ -0,0 +1,216 @@
+/*
+ * Copyright 2026 NXP.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * Neither the name of the NXP Semiconductor nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "bufpool.h"
+#include "libuuu.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+/* each power of two is split into 4 classes, so a request wastes at most 25% */
+#define POOL_SUB_BITS		2
+#define POOL_MIN_SHIFT		6
+#define POOL_MAX_SHIFT		24
+#define POOL_CLASS_NUM		(((POOL_MAX_SHIFT - POOL_MIN_SHIFT) << POOL_SUB_BITS) + 1)
+#define POOL_CLASS_COUNT	256
+#define POOL_LIMIT		(256 * 1024 * 1024)	/* bytes kept in all classes */
+#define POOL_LIMIT_SMALL	(32 * 1024 * 1024)
+#define POOL_HUGEPAGE		(2 * 1024 * 1024)
+
+struct PoolClass
+{
+	mutex m_mutex;
+	vector<void *> m_free;
+};
+
+static atomic<uint64_t> g_pool_hits{0};
+static atomic<uint64_t> g_pool_misses{0};
+static atomic<uint64_t> g_pool_cached{0};
+static atomic<size_t> g_pool_limit{POOL_LIMIT_SMALL};
+static atomic<bool> g_pool_hugepage{false};
+
+/* never destroyed, FileBuffers of static caches give their blocks back at exit */
+static PoolClass * pool_classes()
+{
+	static PoolClass *classes = new PoolClass[POOL_CLASS_NUM];
+	return classes;
+}
+
+static size_t pool_class_size(int c)
+{
+	int shift = POOL_MIN_SHIFT + (c >> POOL_SUB_BITS);
+	size_t sub = c & ((1 << POOL_SUB_BITS) - 1);
+	return ((1 << POOL_SUB_BITS) + sub) << (shift - POOL_SUB_BITS);
+}
+
+/* smallest class holding sz bytes */
+static int pool_class(size_t sz)
+{
+	if (sz <= ((size_t)1 << POOL_MIN_SHIFT))
+		return 0;
+
+	int msb = POOL_MIN_SHIFT;
+	while ((sz - 1) >> (msb + 1))
+		msb++;
+
+	/* steps of a quarter of 1 << msb, the 8th step is the next power of two */
+	int step = msb - POOL_SUB_BITS;
+	int q = (int)((sz + ((size_t)1 << step) - 1) >> step);
+	return ((msb - POOL_MIN_SHIFT) << POOL_SUB_BITS) + q - (1 << POOL_SUB_BITS);
+}
+
+static void * pool_heap_alloc(size_t sz)
+{
+#ifdef __linux__
+	if (sz >= POOL_HUGEPAGE && g_pool_hugepage)
+	{
+		void *p = nullptr;
+		if (posix_memalign(&p, POOL_HUGEPAGE, sz))
+			return nullptr;
+		madvise(p, sz, MADV_HUGEPAGE);
+		return p;
+	}
+#endif
+	return malloc(sz);
+}
+
+void * BufferPool::alloc(size_t sz, size_t *cap)
+{
+	if (sz > ((size_t)1 << POOL_MAX_SHIFT))
+	{
+		g_pool_misses++;
+		if (cap)
+			*cap = sz;
+		return malloc(sz);
+	}
+
+	int c = pool_class(sz);
+	size_t csz = pool_class_size(c);
+	if (cap)
+		*cap = csz;
+
+	{
+		PoolClass &pc = pool_classes()[c];
+		lock_guard<mutex> lock(pc.m_mutex);
+		if (!pc.m_free.empty())
+		{
+			void *p = pc.m_free.back();
+			pc.m_free.pop_back();
+			g_pool_cached -= csz;
+			g_pool_hits++;
+			return p;
+		}
+	}
+
+	g_pool_misses++;
+	return pool_heap_alloc(csz);
+}
+
+void BufferPool::free(void *p, size_t cap)
+{
+	if (p == nullptr)
+		return;
+
+	if (cap > ((size_t)1 << POOL_MAX_SHIFT))
+	{
+		::free(p);
+		return;
+	}
+
+	int c = pool_class(cap);
+	size_t csz = pool_class_size(c);
+
+	/* take the room first, so the classes together never go over the limit */
+	if (g_pool_cached.fetch_add(csz) + csz <= g_pool_limit)
+	{
+		PoolClass &pc = pool_classes()[c];
+		lock_guard<mutex> lock(pc.m_mutex);
+		if (pc.m_free.size() < POOL_CLASS_COUNT)
+		{
+			pc.m_free.push_back(p);
+			return;
+		}
+	}
+	g_pool_cached -= csz;
+
+	::free(p);
+}
+
+void BufferPool::trim()
+{
+	size_t keep = g_pool_limit / 4;
+
+	/* big blocks first, they are what a finished file leaves behind */
+	for (int c = POOL_CLASS_NUM - 1; c >= 0 && g_pool_cached > keep; c--)
+	{
+		size_t csz = pool_class_size(c);
+		vector<void *> drop;
+		{
+			PoolClass &pc = pool_classes()[c];
+			lock_guard<mutex> lock(pc.m_mutex);
+			while (!pc.m_free.empty() && g_pool_cached > keep)
+			{
+				drop.push_back(pc.m_free.back());
+				pc.m_free.pop_back();
+				g_pool_cached -= csz;
+			}
+		}
+
+		for (auto p : drop)
+			::free(p);
+	}
+}
+
+void BufferPool::set_small_memory(bool small)
+{
+	g_pool_limit = small ? POOL_LIMIT_SMALL : POOL_LIMIT;
+	trim();
+}
+
+void uuu_get_buffer_pool_stats(struct uuu_buffer_pool_stats *stats)
+{
+	stats->hits = g_pool_hits;
+	stats->misses = g_pool_misses;
+	stats->cached = g_pool_cached;
+}
+
+void uuu_set_buffer_pool_hugepage(int enable)
+{
+	g_pool_hugepage = !!enable;
+}
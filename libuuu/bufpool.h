@@ -0,0 +1,93 @@
+/*
+ * Copyright 2026 NXP.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * Neither the name of the NXP Semiconductor nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+/*
+ * Size-class pool shared by all FileBuffers. Requests between 64 bytes and
+ * 16M are rounded up to one of 4 classes per power of two, and freed blocks
+ * are kept per class for the next allocation, so the 8M segments of a
+ * streamed file and the DataBuffers of request_data() don't go back to the
+ * OS and page fault again. The classes together keep at most 256M, 32M in
+ * small memory mode. Bigger requests go straight to the heap.
+ */
+class BufferPool
+{
+public:
+	/* *cap gets the usable size, pass it back to free() */
+	static void * alloc(size_t sz, size_t *cap = nullptr);
+	static void free(void *p, size_t cap);
+	/* give cached blocks back to the OS down to a quarter of the limit */
+	static void trim();
+	static void set_small_memory(bool small);
+};
+
+/*
+ * std allocator on top of BufferPool. Elements are default-initialized,
+ * so resizing a byte vector doesn't clear memory that is written next anyway.
+ */
+template <class T>
+class PoolAllocator
+{
+public:
+	using value_type = T;
+
+	PoolAllocator() noexcept {}
+	template <class U>
+	PoolAllocator(const PoolAllocator<U> &) noexcept {}
+
+	T * allocate(size_t n)
+	{
+		void *p = BufferPool::alloc(n * sizeof(T));
+		if (p == nullptr)
+			throw std::bad_alloc();
+		return static_cast<T *>(p);
+	}
+
+	void deallocate(T *p, size_t n) noexcept
+	{
+		BufferPool::free(p, n * sizeof(T));
+	}
+
+	template <class U>
+	void construct(U *p) { ::new ((void *)p) U; }
+	template <class U, class... Args>
+	void construct(U *p, Args&&... args) { ::new ((void *)p) U(std::forward<Args>(args)...); }
+
+	template <class U>
+	bool operator==(const PoolAllocator<U> &) const noexcept { return true; }
+	template <class U>
+	bool operator!=(const PoolAllocator<U> &) const noexcept { return false; }
+};
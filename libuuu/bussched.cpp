@@ -0,0 +1,122 @@
+/*
+ * Copyright 2026 NXP.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * Neither the name of the NXP Semiconductor nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "bussched.h"
+#include "libuuu.h"
+
+#include <atomic>
+#include <map>
+
+using namespace std;
+
+/* 0: measure, >0: fixed number of slices in flight per bus, <0: no limit */
+static atomic<int> g_bus_limit{0};
+
+/* time to measure the throughput of the bus at one limit */
+static constexpr chrono::milliseconds g_bus_window{500};
+
+void uuu_set_usb_bus_limit(int limit)
+{
+	g_bus_limit = limit;
+}
+
+shared_ptr<BusScheduler> get_bus_scheduler(const string &path)
+{
+	static mutex lock;
+	static map<string, shared_ptr<BusScheduler>> buses;
+
+	string bus = path.substr(0, path.find(':'));
+
+	lock_guard<mutex> guard{lock};
+	auto &p = buses[bus];
+	if (!p)
+		p = make_shared<BusScheduler>();
+	return p;
+}
+
+void BusScheduler::acquire()
+{
+	unique_lock<mutex> guard{m_lock};
+
+	uint64_t ticket = m_next_ticket++;
+	int fixed = g_bus_limit;
+	auto can_run = [&] {
+		int limit = fixed > 0 ? fixed : m_limit;
+		return ticket == m_serving && (fixed < 0 || m_active < limit);
+	};
+
+	if (!can_run())
+	{
+		m_contended = true;
+		m_cv.wait(guard, can_run);
+	}
+
+	m_serving++;
+	m_active++;
+
+	/* the next ticket may be able to run too */
+	m_cv.notify_all();
+}
+
+void BusScheduler::release(size_t bytes)
+{
+	lock_guard<mutex> guard{m_lock};
+
+	m_active--;
+	m_window_bytes += bytes;
+	adapt(chrono::steady_clock::now());
+
+	m_cv.notify_all();
+}
+
+void BusScheduler::adapt(chrono::steady_clock::time_point now)
+{
+	auto elapsed = now - m_window_start;
+	if (elapsed < g_bus_window)
+		return;
+
+	/* without waiters the bus was not the bottleneck, the rate tells nothing */
+	if (m_contended && g_bus_limit == 0)
+	{
+		double rate = m_window_bytes / chrono::duration<double>(elapsed).count();
+		double &r = m_rate[m_limit];
+		r = r ? (r + rate) / 2 : rate;
+
+		if (m_limit > 1 && r < m_rate[m_limit - 1] * 1.05)
+			m_limit--;
+		else if (m_limit < m_max_limit && (!m_rate[m_limit + 1] || m_rate[m_limit + 1] > r * 1.05))
+			m_limit++;
+	}
+
+	m_contended = false;
+	m_window_bytes = 0;
+	m_window_start = now;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2026 NXP.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * Neither the name of the NXP Semiconductor nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/*
+ * Share the bandwidth of one usb bus (host controller and its hubs) between
+ * the boards attached to it. A bulk write takes a slot for each slice of
+ * data; at most g_bus_limit slices run at once, or m_limit in auto mode,
+ * and the others wait in FIFO order. Writes of one request, such as
+ * commands, don't take a slot. In auto mode m_limit climbs while the
+ * aggregate throughput of the bus still improves and falls back when the
+ * extra slot did not help.
+ */
+class BusScheduler
+{
+public:
+	class Slot
+	{
+	public:
+		Slot(BusScheduler *bus, size_t bytes) : m_bus{bus}, m_bytes{bytes}
+		{
+			if (m_bus)
+				m_bus->acquire();
+		}
+		~Slot()
+		{
+			if (m_bus)
+				m_bus->release(m_bytes);
+		}
+		Slot(const Slot&) = delete;
+		Slot& operator=(const Slot&) = delete;
+
+	private:
+		BusScheduler * const m_bus;
+		const size_t m_bytes;
+	};
+
+private:
+	static constexpr int m_max_limit = 16;
+
+	void acquire();
+	void release(size_t bytes);
+	void adapt(std::chrono::steady_clock::time_point now);
+
+	std::mutex m_lock;
+	std::condition_variable m_cv;
+	uint64_t m_next_ticket = 0;
+	uint64_t m_serving = 0;
+	int m_active = 0;
+	int m_limit = 1;
+	bool m_contended = false;
+	uint64_t m_window_bytes = 0;
+	std::chrono::steady_clock::time_point m_window_start = std::chrono::steady_clock::now();
+	/* aggregate bytes per second measured at each limit while there were waiters */
+	double m_rate[m_max_limit + 1] = {};
+};
+
+/* path is the usb path from get_device_path(), "bus:ports" */
+std::shared_ptr<BusScheduler> get_bus_scheduler(const std::string &path);
@@ -250,6 +250,13 @@ int CmdBase::dump()
 	return 0;
 }
 
+static atomic<bool> g_ucmd_batch{false};
+
+void uuu_set_ucmd_batch(int enable)
+{
+	g_ucmd_batch = enable != 0;
+}
+
 int CmdList::run_all(CmdCtx *p, bool dry)
 {
 	CmdList::iterator it;
@@ -261,11 +268,41 @@ int CmdList::run_all(CmdCtx *p, bool dry)
 	call_notify(nt);
 
 	int i = 0;
+	int replay_until = 0;
 
 	for (it = begin(); it != end(); it++, i++)
 	{
 		uuu_notify nt;
 
+		size_t batch = (!dry && g_ucmd_batch && i >= replay_until) ? FBUCmd::batch_size(it, end()) : 0;
+		if (batch)
+		{
+			if (FBUCmd::run_batch(p, it, batch) == 0)
+			{
+				for (size_t j = 0; j < batch; j++)
+				{
+					nt.type = uuu_notify::NOTIFY_CMD_INDEX;
+					nt.index = i + j;
+					call_notify(nt);
+
+					nt.type = uuu_notify::NOTIFY_CMD_START;
+					nt.str = (char *)it[j]->get_cmd().c_str();
+					call_notify(nt);
+
+					nt.type = uuu_notify::NOTIFY_CMD_END;
+					nt.status = 0;
+					call_notify(nt);
+				}
+				it += batch - 1;
+				i += batch - 1;
+				ret = 0;
+				continue;
+			}
+
+			/* run them one by one to report which one failed */
+			replay_until = i + static_cast<int>(batch);
+		}
+
 		nt.type = uuu_notify::NOTIFY_CMD_INDEX;
 		nt.index = i;
 		call_notify(nt);
@@ -37,6 +37,7 @@
 #include <vector>
 
 class ConfigItem;
+class USBSession;
 
 std::string get_next_param(const std::string &cmd, size_t &pos, char separate = ' ');
 
@@ -51,6 +52,12 @@ public:
 	ConfigItem *m_config_item = nullptr;
 	void *m_dev = nullptr;
 	short m_current_bcd;
+
+	/* fastboot getvar results of this device, see FBGetVar::get() */
+	std::map<std::string, std::string> m_fb_vars;
+	bool m_fb_vars_all = false;	/* getvar:all was tried */
+	int m_fb_hush = -1;		/* u-boot runs "a && b", -1 not asked yet */
+	int m_fb_crc32 = -1;		/* u-boot "crc32 -v" works, -1 not asked yet */
 };
 
 class CmdUsbCtx : public CmdCtx
@@ -58,6 +65,11 @@ class CmdUsbCtx : public CmdCtx
 public:
 	~CmdUsbCtx() override;
 	int look_for_match_device(const char * protocol);
+	/* take over an opened libusb device handle for all commands */
+	void open_session(void *devhandle);
+
+private:
+	std::unique_ptr<USBSession> m_session;
 };
 
 struct Param
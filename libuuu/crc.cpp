@@ -0,0 +1,211 @@
+/*
+ * Copyright 2026 NXP.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * Neither the name of the NXP Semiconductor nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "crc.h"
+#include "zlib.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CRC_PCLMUL
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC_PCLMUL_TARGET
+#else
+#define CRC_PCLMUL_TARGET __attribute__((target("pclmul,sse4.1")))
+#endif
+#endif
+
+/* zlib takes 32bit lengths */
+static uint32_t crc32_zlib(uint32_t crc, const uint8_t *p, size_t sz)
+{
+	while (sz)
+	{
+		uInt n = (uInt)min(sz, (size_t)0x40000000);
+		crc = crc32(crc, p, n);
+		p += n;
+		sz -= n;
+	}
+	return crc;
+}
+
+#ifdef CRC_PCLMUL
+/*
+ * Fold 4x128 bits at a time with carry-less multiply, then reduce with
+ * Barrett, see Intel "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction". crc is not inverted here, sz >= 64 and a
+ * multiple of 16.
+ */
+CRC_PCLMUL_TARGET
+static uint32_t crc32_pclmul_fold(uint32_t crc, const uint8_t *p, size_t sz)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+	__m128i x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	__m128i x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	__m128i x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	__m128i x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	__m128i t;
+
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	p += 64;
+	sz -= 64;
+
+	while (sz >= 64)
+	{
+		__m128i y1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		__m128i y2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		__m128i y3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		__m128i y4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, y1), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, y2), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, y3), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, y4), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+
+		p += 64;
+		sz -= 64;
+	}
+
+	/* 4x128 -> 128 */
+	t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), t);
+	t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), t);
+	t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), t);
+
+	for (; sz >= 16; p += 16, sz -= 16)
+	{
+		t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_loadu_si128((const __m128i *)p)), t);
+	}
+
+	/* 128 -> 64 */
+	t = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t);
+	t = _mm_srli_si128(x1, 4);
+	x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask), k5k0, 0x00), t);
+
+	/* Barrett reduction to 32 bits */
+	t = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), poly, 0x10);
+	t = _mm_clmulepi64_si128(_mm_and_si128(t, mask), poly, 0x00);
+	x1 = _mm_xor_si128(x1, t);
+
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *p, size_t sz)
+{
+	if (sz < 64)
+		return crc32_zlib(crc, p, sz);
+
+	size_t n = sz & ~(size_t)15;
+	crc = ~crc32_pclmul_fold(~crc, p, n);
+	return crc32_zlib(crc, p + n, sz - n);
+}
+
+static bool has_pclmul()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	/* PCLMULQDQ and SSE4.1 */
+	return (info[2] & ((1 << 1) | (1 << 19))) == ((1 << 1) | (1 << 19));
+#else
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+#endif
+
+using Crc32Fn = uint32_t (*)(uint32_t crc, const uint8_t *p, size_t sz);
+
+static Crc32Fn select_crc32()
+{
+#ifdef CRC_PCLMUL
+	return has_pclmul() ? crc32_pclmul : crc32_zlib;
+#else
+	return crc32_zlib;
+#endif
+}
+
+static const Crc32Fn g_crc32 = select_crc32();
+
+/* smaller pieces are not worth a thread */
+static const size_t g_crc32_piece = 0x800000;
+
+uint32_t crc32_fast(uint32_t crc, const void *data, size_t sz)
+{
+	return g_crc32(crc, (const uint8_t *)data, sz);
+}
+
+uint32_t crc32_parallel(uint32_t crc, const void *data, size_t sz)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	size_t n = min((size_t)max(thread::hardware_concurrency(), 1u), sz / g_crc32_piece);
+	if (n < 2)
+		return crc32_fast(crc, p, sz);
+
+	size_t each = (sz / n + 15) & ~(size_t)15;
+	vector<uint32_t> crcs(n);
+	vector<size_t> sizes(n);
+	vector<thread> workers;
+	for (size_t i = 0; i < n; i++)
+	{
+		size_t off = i * each;
+		sizes[i] = min(each, sz - off);
+		if (i)
+			workers.emplace_back([&, i, off] { crcs[i] = crc32_fast(0, p + off, sizes[i]); });
+	}
+	crcs[0] = crc32_fast(crc, p, sizes[0]);
+
+	for (auto &w : workers)
+		w.join();
+
+	crc = crcs[0];
+	for (size_t i = 1; i < n; i++)
+		crc = crc32_combine(crc, crcs[i], (z_off_t)sizes[i]);
+	return crc;
+}
@@ -0,0 +1,434 @@
+/*
+ * Copyright 2026 NXP.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * Neither the name of the NXP Semiconductor nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "emulator.h"
+#include "buffer.h"
+#include "libcomm.h"
+#include "liberror.h"
+#include "sdp.h"
+#include "sparse.h"
+
+#include <cstring>
+#include <thread>
+
+using namespace std;
+
+#define EMU_UCP_CHUNK	0x10000
+
+/* SDPS command report, see _ST_HID_CBW in sdps.cpp */
+#define EMU_BLTC_SIGNATURE	0x43544C42
+#define EMU_CBW_XFER_OFF	8
+
+EmuDevice::EmuDevice()
+{
+	m_vars["max-download-size"] = "0x10000000";
+	m_vars["logical-block-size"] = "0x1000";
+	m_vars["version"] = "0.4";
+	m_vars["product"] = "uuu-emulator";
+	m_clock = chrono::steady_clock::now();
+}
+
+/*
+ * Account the bus time of a transfer. The device keeps its own clock so
+ * that sleep overshoot is not added up for small transfers.
+ */
+void EmuDevice::bus(size_t size, size_t transfers)
+{
+	m_transfers += transfers;
+
+	chrono::nanoseconds cost{chrono::microseconds(m_latency_us)};
+	if (m_bandwidth)
+		cost += chrono::nanoseconds(size * 1000000000ull / m_bandwidth);
+
+	if (cost.count() == 0)
+		return;
+
+	auto now = chrono::steady_clock::now();
+	if (now - m_clock > chrono::milliseconds(1))
+		m_clock = now;
+
+	m_clock += cost;
+	if (m_clock > now)
+		this_thread::sleep_until(m_clock);
+}
+
+void EmuDevice::respond(const string &s)
+{
+	m_response.emplace_back(s.begin(), s.end());
+}
+
+void EmuDevice::respond_status(uint8_t report_id, uint32_t status)
+{
+	vector<uint8_t> r(1 + sizeof(status));
+	r[0] = report_id;
+	memcpy(r.data() + 1, &status, sizeof(status));
+	m_response.push_back(r);
+}
+
+int EmuDevice::write(TransType type, const uint8_t *p, size_t size)
+{
+	bus(size);
+	m_tx_bytes += size;
+
+	if (type == TransType::hid)
+		return hid_report(p, size);
+
+	if (m_expect)
+	{
+		size_t sz = size < m_expect ? size : m_expect;
+		m_sink->insert(m_sink->end(), p, p + sz);
+		m_expect -= sz;
+		if (m_expect == 0)
+			respond("OKAY");
+		return 0;
+	}
+
+	return fb_command(string((const char *)p, size));
+}
+
+int EmuDevice::write_reports(const uint8_t *p, size_t size, size_t stride)
+{
+	/* queued reports share one round trip */
+	size_t count = (size + stride - 1) / stride;
+	bus(size, count);
+	m_tx_bytes += size;
+
+	for (size_t off = 0; off < size; off += stride)
+	{
+		size_t sz = size - off;
+		if (sz > stride)
+			sz = stride;
+
+		int ret = hid_report(p + off, sz);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+int EmuDevice::read(TransType type, uint8_t *p, size_t size, size_t *return_size)
+{
+	*return_size = 0;
+
+	if (m_response.empty())
+	{
+		set_last_err_string(type == TransType::hid ? "HID(R):emulator timeout" : "Bulk(R):emulator timeout");
+		return -1;
+	}
+
+	vector<uint8_t> &r = m_response.front();
+	size_t sz = r.size() < size ? r.size() : size;
+
+	bus(sz);
+	m_rx_bytes += sz;
+
+	memcpy(p, r.data(), sz);
+	*return_size = sz;
+
+	if (sz < r.size())
+		r.erase(r.begin(), r.begin() + sz);
+	else
+		m_response.pop_front();
+
+	return 0;
+}
+
+int EmuDevice::fb_command(const string &cmd)
+{
+	size_t pos = cmd.find(':');
+	string name = cmd.substr(0, pos);
+	string arg = pos == string::npos ? string() : cmd.substr(pos + 1);
+
+	if (name == "getvar")
+	{
+		if (arg == "all")
+		{
+			for (auto &v : m_vars)
+				respond("INFO" + v.first + ": " + v.second);
+			respond("OKAY");
+			return 0;
+		}
+
+		auto it = m_vars.find(arg);
+		if (it == m_vars.end())
+			respond("FAILVariable not implemented");
+		else
+			respond("OKAY" + it->second);
+		return 0;
+	}
+
+	if (name == "download" || name == "donwload")
+	{
+		size_t sz = strtoul(arg.c_str(), nullptr, 16);
+		if (sz > str_to_uint64(m_vars["max-download-size"]))
+		{
+			respond("FAILdata too large");
+			return 0;
+		}
+
+		if (name == "download")
+		{
+			m_download.clear();
+			m_sink = &m_download;
+		}
+		else
+		{
+			/* ucp data goes to the file opened by WOpen */
+			m_sink = &m_files[m_open];
+		}
+
+		m_expect = sz;
+
+		string_ex s;
+		s.format("DATA%08x", (unsigned int)sz);
+		respond(s);
+		if (sz == 0)
+			respond("OKAY");
+		return 0;
+	}
+
+	if (name == "flash")
+		return fb_flash(arg);
+
+	if (name == "upload")
+		return fb_upload();
+
+	if (name == "WOpen")
+	{
+		m_open = arg;
+		m_files[arg].clear();
+		respond("OKAY");
+		return 0;
+	}
+
+	if (name == "ROpen")
+	{
+		auto it = m_files.find(arg);
+		if (it == m_files.end())
+		{
+			respond("FAILno such file");
+			return 0;
+		}
+
+		m_open = arg;
+		m_rpos = 0;
+
+		string_ex s;
+		s.format("OKAY%x", (unsigned int)it->second.size());
+		respond(s);
+		return 0;
+	}
+
+	if (name == "Close")
+		m_open.clear();
+
+	/* UCmd, ACmd, oem, erase, reboot ... always succeed */
+	respond("OKAY");
+	return 0;
+}
+
+int EmuDevice::fb_flash(const string &partition)
+{
+	uint64_t bytes = m_download.size();
+
+	if (m_download.size() >= sizeof(sparse_header) &&
+		SparseFile::is_validate_sparse_file(m_download.data(), m_download.size()))
+	{
+		sparse_header *h = (sparse_header *)m_download.data();
+		size_t pos = h->file_hdr_sz;
+		uint64_t blks = 0;
+
+		for (uint32_t i = 0; i < h->total_chunks; i++)
+		{
+			if (pos + sizeof(chunk_header_t) > m_download.size())
+			{
+				respond("FAILsparse image truncated");
+				return 0;
+			}
+
+			chunk_header_t *c = (chunk_header_t *)(m_download.data() + pos);
+			size_t data = c->total_sz - h->chunk_hdr_sz;
+
+			if (c->total_sz < h->chunk_hdr_sz || pos + c->total_sz > m_download.size() ||
+				(c->chunk_type == CHUNK_TYPE_RAW && data != (uint64_t)c->chunk_sz * h->blk_sz) ||
+				(c->chunk_type == CHUNK_TYPE_FILL && data != sizeof(uint32_t)))
+			{
+				respond("FAILsparse chunk size mismatch");
+				return 0;
+			}
+
+			if (c->chunk_type != CHUNK_TYPE_CRC32)
+				blks += c->chunk_sz;
+			pos += c->total_sz;
+		}
+
+		if (blks != h->total_blks)
+		{
+			respond("FAILsparse block count mismatch");
+			return 0;
+		}
+
+		bytes = blks * h->blk_sz;
+	}
+
+	m_partitions[partition] += bytes;
+	respond("OKAY");
+	return 0;
+}
+
+int EmuDevice::fb_upload()
+{
+	const vector<uint8_t> *src = &m_download;
+	size_t off = 0;
+	size_t sz = m_download.size();
+
+	if (!m_open.empty())
+	{
+		src = &m_files[m_open];
+		off = m_rpos;
+		sz = src->size() - off;
+		if (sz > EMU_UCP_CHUNK)
+			sz = EMU_UCP_CHUNK;
+		m_rpos += sz;
+	}
+
+	string_ex s;
+	s.format("DATA%08x", (unsigned int)sz);
+	respond(s);
+	if (sz)
+		m_response.emplace_back(src->begin() + off, src->begin() + off + sz);
+	respond("OKAY");
+	return 0;
+}
+
+int EmuDevice::hid_report(const uint8_t *p, size_t size)
+{
+	if (size < 1)
+		return 0;
+
+	if (p[0] == 2)
+	{
+		size_t sz = size - 1;
+		if (sz > m_expect)
+			sz = m_expect;
+		m_expect -= sz;
+
+		if (m_expect == 0 && m_sdp_cmd)
+		{
+			respond_status(3, SDPCmdBase::HabDisabled);
+			respond_status(4, m_sdp_cmd == ROM_KERNEL_CMD_DCD_WRITE ? ROM_WRITE_ACK : ROM_STATUS_ACK);
+			m_sdp_cmd = 0;
+		}
+		return 0;
+	}
+
+	if (p[0] != 1)
+	{
+		set_last_err_string("HID(W):emulator unknown report id");
+		return -1;
+	}
+
+	uint32_t signature = 0;
+	if (size >= 1 + EMU_CBW_XFER_OFF + sizeof(uint32_t))
+		memcpy(&signature, p + 1, sizeof(signature));
+
+	if (signature == EMU_BLTC_SIGNATURE)
+	{
+		/* SDPS: the ROM takes the image and answers nothing */
+		uint32_t len;
+		memcpy(&len, p + 1 + EMU_CBW_XFER_OFF, sizeof(len));
+		m_expect = len;
+		m_sdp_cmd = 0;
+		return 0;
+	}
+
+	SDPCmd cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	memcpy(&cmd, p + 1, size - 1 < sizeof(cmd) ? size - 1 : sizeof(cmd));
+
+	switch (cmd.m_cmd)
+	{
+	case ROM_KERNEL_CMD_WR_FILE:
+	case ROM_KERNEL_CMD_DCD_WRITE:
+		m_expect = EndianSwap(cmd.m_count);
+		m_sdp_cmd = cmd.m_cmd;
+		break;
+	case ROM_KERNEL_CMD_SKIP_DCD_HEADER:
+	case ROM_KERNEL_CMD_JUMP_ADDR:
+		respond_status(3, SDPCmdBase::HabDisabled);
+		respond_status(4, ROM_OK_ACK);
+		break;
+	case ROM_KERNEL_CMD_WR_MEM:
+		respond_status(3, SDPCmdBase::HabDisabled);
+		respond_status(4, ROM_WRITE_ACK);
+		break;
+	case ROM_KERNEL_CMD_RD_MEM:
+	case ROM_KERNEL_CMD_ERROR_STATUS:
+		respond_status(3, SDPCmdBase::HabDisabled);
+		respond_status(4, ROM_STATUS_ACK);
+		break;
+	default:
+		set_last_err_string("HID(W):emulator unknown SDP command");
+		return -1;
+	}
+	return 0;
+}
+
+int EmuTrans::open(void *p)
+{
+	m_emu = static_cast<EmuDevice *>(p);
+	if (m_emu == nullptr)
+	{
+		set_last_err_string("no emulated device");
+		return -1;
+	}
+	return 0;
+}
+
+int EmuTrans::write(void *buff, size_t size)
+{
+	return m_emu->write(m_type, (const uint8_t *)buff, size);
+}
+
+int EmuTrans::write_reports(void *buff, size_t size, size_t stride)
+{
+	return m_emu->write_reports((const uint8_t *)buff, size, stride);
+}
+
+int EmuTrans::read(void *buff, size_t size, size_t *return_size)
+{
+	return m_emu->read(m_type, (uint8_t *)buff, size, return_size);
+}
+
+unique_ptr<TransBase> emu_create_trans(TransType type, int /*timeout*/)
+{
+	return unique_ptr<TransBase>(new EmuTrans(type));
+}
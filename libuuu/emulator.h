@@ -0,0 +1,109 @@
+/*
+ * Copyright 2026 NXP.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * Neither the name of the NXP Semiconductor nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#pragma once
+
+#include "trans.h"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * In-process stand-in for a board, so the protocol commands can be run
+ * without hardware. It answers the fastboot protocol (getvar, download,
+ * flash, ucmd, upload, ucp) on the bulk transport and the SDP/SDPS ROM
+ * reports on the HID transport.
+ *
+ * Usage: install emu_create_trans() with set_trans_factory() and point
+ * CmdCtx::m_dev at an EmuDevice.
+ */
+class EmuDevice
+{
+public:
+	EmuDevice();
+
+	int write(TransType type, const uint8_t *p, size_t size);
+	int write_reports(const uint8_t *p, size_t size, size_t stride);
+	int read(TransType type, uint8_t *p, size_t size, size_t *return_size);
+
+	/* bytes per second on the emulated bus, 0 is unlimited */
+	uint64_t m_bandwidth = 0;
+	/* cost of one transfer round trip */
+	unsigned int m_latency_us = 0;
+
+	std::map<std::string, std::string> m_vars;
+	/* bytes written to each partition, sparse images counted expanded */
+	std::map<std::string, uint64_t> m_partitions;
+	std::map<std::string, std::vector<uint8_t>> m_files;
+	std::vector<uint8_t> m_download;
+
+	uint64_t m_tx_bytes = 0;
+	uint64_t m_rx_bytes = 0;
+	uint64_t m_transfers = 0;
+
+private:
+	void bus(size_t size, size_t transfers = 1);
+	void respond(const std::string &s);
+	void respond_status(uint8_t report_id, uint32_t status);
+	int fb_command(const std::string &cmd);
+	int fb_flash(const std::string &partition);
+	int fb_upload();
+	int hid_report(const uint8_t *p, size_t size);
+
+	std::deque<std::vector<uint8_t>> m_response;
+	std::vector<uint8_t> *m_sink = nullptr;
+	size_t m_expect = 0;
+	uint16_t m_sdp_cmd = 0;
+	std::string m_open;
+	size_t m_rpos = 0;
+	std::chrono::steady_clock::time_point m_clock;
+};
+
+class EmuTrans : public TransBase
+{
+public:
+	EmuTrans(TransType type) : m_type{type} {}
+
+	int open(void *p) override;
+	int write(void *buff, size_t size) override;
+	int write_reports(void *buff, size_t size, size_t stride) override;
+	int read(void *buff, size_t size, size_t *return_size) override;
+
+private:
+	const TransType m_type;
+	EmuDevice *m_emu = nullptr;
+};
+
+std::unique_ptr<TransBase> emu_create_trans(TransType type, int timeout);
@@ -44,6 +44,7 @@
 #include <fstream>
 #include <sys/stat.h>
 #include "sparse.h"
+#include "crc.h"
 #include "ffu_format.h"
 #include "libcomm.h"
 #include "trans.h"
@@ -52,8 +53,382 @@
 #include "zlib.h"
 #include "libusb.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+
 int FastBoot::Transport(string cmd, void *p, size_t size, vector<uint8_t> *input)
 {
+	vector<TransSegment> data;
+	if (size)
+		data.push_back({ p, size });
+	return Transport(cmd, data, input);
+}
+
+/* read the whole DATA phase into a vector */
+class VectorSink : public FBDataSink
+{
+public:
+	VectorSink(vector<uint8_t> *v) : m_v{v} {}
+
+	int begin(size_t sz) override
+	{
+		m_v->resize(sz);
+		m_pos = 0;
+		return 0;
+	}
+	uint8_t *get(size_t &sz) override
+	{
+		sz = min(sz, m_v->size() - m_pos);
+		return m_v->data() + m_pos;
+	}
+	int commit(size_t sz) override
+	{
+		m_pos += sz;
+		return 0;
+	}
+
+private:
+	vector<uint8_t> *m_v;
+	size_t m_pos = 0;
+};
+
+/*
+ * Save an upload to a file. The usb reads fill m_each sized buffers which
+ * a writer thread saves in order, so at most m_depth buffers are in memory
+ * and the next read overlaps the disk write.
+ */
+class FileSink : public FBDataSink
+{
+public:
+	FileSink(size_t each = 0x400000, size_t depth = 3) : m_each{each}, m_depth{depth} {}
+	~FileSink() { close(); }
+
+	int open(const string &path)
+	{
+		m_fp = fopen(path.c_str(), "wb");
+		if (m_fp == nullptr)
+		{
+			string err = "Fail to open file ";
+			err += path;
+			set_last_err_string(err);
+			return -1;
+		}
+		m_writer = thread(&FileSink::write_loop, this);
+		return 0;
+	}
+
+	/* ask the file system for sz more bytes up front, best effort */
+	void reserve(size_t sz)
+	{
+#ifdef __linux__
+		if (m_fp && sz)
+			fallocate(fileno(m_fp), FALLOC_FL_KEEP_SIZE, m_received, sz);
+#else
+		(void)sz;
+#endif
+	}
+
+	int begin(size_t sz) override
+	{
+		reserve(sz);
+		return m_error ? -1 : 0;
+	}
+
+	uint8_t *get(size_t &sz) override
+	{
+		if (!m_cur)
+		{
+			unique_lock<mutex> lock(m_lock);
+			m_cv.wait(lock, [this] { return m_error || !m_free.empty() || m_count < m_depth; });
+			if (m_error)
+			{
+				set_last_err_string("Fail to write file");
+				return nullptr;
+			}
+			if (m_free.empty())
+			{
+				m_cur.reset(new vector<uint8_t>(m_each));
+				m_count++;
+			}
+			else
+			{
+				m_cur = std::move(m_free.back());
+				m_free.pop_back();
+			}
+			m_fill = 0;
+		}
+		sz = min(sz, m_each - m_fill);
+		return m_cur->data() + m_fill;
+	}
+
+	int commit(size_t sz) override
+	{
+		m_fill += sz;
+		m_received += sz;
+		if (m_fill == m_each)
+			flush();
+		return m_error ? -1 : 0;
+	}
+
+	/* write what is left and wait for the disk */
+	int close()
+	{
+		if (m_fp == nullptr)
+			return m_error ? -1 : 0;
+
+		flush();
+		{
+			lock_guard<mutex> lock(m_lock);
+			m_done = true;
+		}
+		m_cv.notify_all();
+		m_writer.join();
+
+		if (fclose(m_fp))
+			m_error = true;
+		m_fp = nullptr;
+
+		if (m_error)
+		{
+			set_last_err_string("Fail to write file");
+			return -1;
+		}
+		return 0;
+	}
+
+	size_t received() const { return m_received; }
+
+private:
+	struct Block
+	{
+		unique_ptr<vector<uint8_t>> buff;
+		size_t size;
+	};
+
+	void flush()
+	{
+		if (!m_cur || !m_fill)
+			return;
+		{
+			lock_guard<mutex> lock(m_lock);
+			m_queue.push_back({ std::move(m_cur), m_fill });
+		}
+		m_cv.notify_all();
+		m_fill = 0;
+	}
+
+	void write_loop()
+	{
+		while (true)
+		{
+			Block b;
+			{
+				unique_lock<mutex> lock(m_lock);
+				m_cv.wait(lock, [this] { return m_done || !m_queue.empty(); });
+				if (m_queue.empty())
+					break;
+				b = std::move(m_queue.front());
+				m_queue.pop_front();
+			}
+
+			bool ok = m_error || fwrite(b.buff->data(), 1, b.size, m_fp) == b.size;
+			{
+				lock_guard<mutex> lock(m_lock);
+				if (!ok)
+					m_error = true;
+				m_free.push_back(std::move(b.buff));
+			}
+			m_cv.notify_all();
+		}
+	}
+
+	const size_t m_each;
+	const size_t m_depth;
+	FILE *m_fp = nullptr;
+	thread m_writer;
+	mutex m_lock;
+	condition_variable m_cv;
+	deque<Block> m_queue;
+	vector<unique_ptr<vector<uint8_t>>> m_free;
+	size_t m_count = 0;
+	bool m_done = false;
+	atomic<bool> m_error{false};
+
+	unique_ptr<vector<uint8_t>> m_cur;
+	size_t m_fill = 0;
+	size_t m_received = 0;
+};
+
+int FastBoot::Transport(string cmd, const vector<TransSegment> &data, vector<uint8_t> *input)
+{
+	if (input == nullptr)
+		return Transport(cmd, data, (FBDataSink*)nullptr);
+
+	VectorSink sink(input);
+	return Transport(cmd, data, &sink);
+}
+
+int FastBoot::Transport(string cmd, const vector<TransSegment> &data, FBDataSink *sink)
+{
+	auto send = [&](size_t sz) {
+		/* send no more than the device asked for */
+		vector<TransSegment> segs;
+		for (auto seg : data)
+		{
+			if (seg.size > sz)
+				seg.size = sz;
+			sz -= seg.size;
+			if (seg.size)
+				segs.push_back(seg);
+		}
+
+		return segs.empty() ? 0 : m_pTrans->writev(segs);
+	};
+
+	return exchange(cmd, send, sink);
+}
+
+/* downloads from a FileBuffer are read in windows of this size */
+static const size_t g_fb_stream_window = 0x400000;
+
+int FastBoot::Transport(string cmd, shared_ptr<FileBuffer> p, size_t offset, size_t sz)
+{
+	auto send = [&](size_t asked) {
+		size_t left = min(sz, asked);
+		if (!left)
+			return 0;
+
+		/* one reader thread reads the next window while this one is on the wire */
+		deque<shared_ptr<DataBuffer>> ready;
+		mutex lock;
+		condition_variable cv;
+		bool stop = false;
+
+		thread reader([&] {
+			size_t pos = offset;
+			size_t remain = left;
+			while (remain)
+			{
+				{
+					unique_lock<mutex> l(lock);
+					cv.wait(l, [&] { return stop || ready.empty(); });
+					if (stop)
+						break;
+				}
+
+				shared_ptr<DataBuffer> b;
+				try {
+					b = p->request_data(pos, min(remain, g_fb_stream_window));
+				} catch (const std::exception &e) {
+					set_last_err_string(e.what());
+				}
+				size_t n = b ? min(b->size(), remain) : 0;
+
+				lock_guard<mutex> l(lock);
+				ready.push_back(b);
+				cv.notify_all();
+				if (!n)
+					break;
+				pos += n;
+				remain -= n;
+			}
+		});
+
+		int ret = 0;
+		while (left)
+		{
+			shared_ptr<DataBuffer> cur;
+			{
+				unique_lock<mutex> l(lock);
+				cv.wait(l, [&] { return !ready.empty(); });
+				cur = ready.front();
+				ready.pop_front();
+			}
+			cv.notify_all();
+
+			if (!cur || !cur->size())
+			{
+				set_last_err_string("some data missed");
+				ret = -1;
+				break;
+			}
+
+			size_t n = min(cur->size(), left);
+			if (m_pTrans->write(cur->data(), n))
+			{
+				ret = -1;
+				break;
+			}
+			left -= n;
+		}
+
+		{
+			lock_guard<mutex> l(lock);
+			stop = true;
+		}
+		cv.notify_all();
+		reader.join();
+		return ret;
+	};
+
+	return exchange(cmd, send, nullptr);
+}
+
+/* drop the cached getvar results that cmd may change */
+static void fb_vars_update(CmdCtx *ctx, const string &cmd)
+{
+	if (ctx == nullptr)
+		return;
+
+	static const char * const keep[] = { "getvar:", "download:", "donwload:", "upload", "WOpen:", "ROpen:", "Close" };
+	for (auto k : keep)
+		if (!cmd.compare(0, strlen(k), k))
+			return;
+
+	static const char * const leave[] = { "reboot", "continue", "boot" };
+	for (auto k : leave)
+		if (!cmd.compare(0, strlen(k), k))
+		{
+			ctx->m_fb_vars.clear();
+			ctx->m_fb_vars_all = false;
+			ctx->m_fb_hush = -1;
+			ctx->m_fb_crc32 = -1;
+			return;
+		}
+
+	/* a u-boot command may change any variable, setenv fastboot.* or mmc dev */
+	static const char * const ucmd[] = { "UCmd:", "ACmd:" };
+	for (auto k : ucmd)
+		if (!cmd.compare(0, strlen(k), k))
+		{
+			ctx->m_fb_vars.clear();
+			ctx->m_fb_vars_all = false;
+			return;
+		}
+
+	/* anything else may change the partition table */
+	for (auto it = ctx->m_fb_vars.begin(); it != ctx->m_fb_vars.end();)
+	{
+		if (!it->first.compare(0, 10, "partition-"))
+			it = ctx->m_fb_vars.erase(it);
+		else
+			++it;
+	}
+}
+
+int FastBoot::exchange(string cmd, const function<int(size_t)> &send, FBDataSink *sink)
+{
+	fb_vars_update(m_ctx, cmd);
+
 	if (m_pTrans->write((void*)cmd.data(), cmd.size()))
 		return -1;
 
@@ -72,27 +447,31 @@ int FastBoot::Transport(string cmd, void *p, size_t size, vector<uint8_t> *input
 			size_t sz;
 			sz = strtoul(buff+4, nullptr, 16);
 
-			if (input)
+			if (sink)
 			{
 				size_t rz, rsize = 0;
 
-				input->resize(sz);
+				if (sink->begin(sz))
+					return -1;
 				while (rsize < sz)
 				{
-					if (m_pTrans->read(input->data() + rsize, sz - rsize, &rz))
+					size_t room = sz - rsize;
+					uint8_t *p = sink->get(room);
+					if (p == nullptr)
+						return -1;
+					if (m_pTrans->read(p, room, &rz))
 					{
 						set_last_err_string("Error on DATA read!");
 						return -1;
 					}
+					if (sink->commit(rz))
+						return -1;
 					rsize += rz;
 				}
 			}
 			else
 			{
-				if (sz > size)
-					sz = size;
-
-				if (m_pTrans->write(p, sz))
+				if (send(sz))
 					return -1;
 			}
 		}else
@@ -100,6 +479,10 @@ int FastBoot::Transport(string cmd, void *p, size_t size, vector<uint8_t> *input
 			string s;
 			s = buff + 4;
 			m_info += s;
+			if (strncmp(buff, "INFO", 4) == 0)
+				m_info_lines.push_back(s);
+			if (m_quiet)
+				continue;
 			uuu_notify nt;
 			nt.type = uuu_notify::NOTIFY_CMD_INFO;
 			nt.str = buff + 4;
@@ -110,7 +493,8 @@ int FastBoot::Transport(string cmd, void *p, size_t size, vector<uint8_t> *input
 	if (strncmp(buff, "OKAY", 4) == 0)
 		return 0;
 
-	set_last_err_string(m_info);
+	if (!m_quiet)
+		set_last_err_string(m_info);
 	return -1;
 }
 
@@ -138,11 +522,12 @@ int FBGetVar::parser(char *p)
 }
 int FBGetVar::run(CmdCtx *ctx)
 {
-	BulkTrans dev;
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::bulk, 2000);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	FastBoot fb(&dev);
+	FastBoot fb(dev.get(), ctx);
+	fb.m_quiet = m_quiet;
 	string cmd;
 	cmd = "getvar:";
 	cmd += m_var;
@@ -151,6 +536,7 @@ int FBGetVar::run(CmdCtx *ctx)
 		return -1;
 
 	m_val = fb.m_info;
+	ctx->m_fb_vars[m_var] = m_val;
 
 	string key = "@";
 	key += str_to_upper(m_var);
@@ -159,6 +545,53 @@ int FBGetVar::run(CmdCtx *ctx)
 	return 0;
 }
 
+int FBGetVar::get(CmdCtx *ctx, const string &var, string &val, bool quiet)
+{
+	/* one getvar:all fills most of the cache, old u-boot just fails it */
+	if (!ctx->m_fb_vars_all)
+	{
+		ctx->m_fb_vars_all = true;
+
+		auto dev = create_trans(TransType::bulk, 2000);
+		if (dev->open(ctx->m_dev))
+			return -1;
+
+		/* fill the cache only, the dump isn't shown and FAIL is expected */
+		FastBoot fb(dev.get(), ctx);
+		fb.m_quiet = true;
+		if (!fb.Transport("getvar:all", nullptr, 0))
+		{
+			for (auto &l : fb.m_info_lines)
+			{
+				size_t pos = l.find(": ");
+				if (pos != string::npos)
+					ctx->m_fb_vars[l.substr(0, pos)] = l.substr(pos + 2);
+			}
+		}
+	}
+
+	FBGetVar getvar(nullptr);
+	getvar.m_var = var;
+	getvar.m_quiet = quiet;
+
+	auto it = ctx->m_fb_vars.find(var);
+	if (it == ctx->m_fb_vars.end())
+	{
+		if (getvar.run(ctx))
+			return -1;
+		val = getvar.m_val;
+		return 0;
+	}
+
+	val = it->second;
+
+	string key = "@";
+	key += str_to_upper(var);
+	key += "@";
+	insert_env_variable(key, str_to_upper(val));
+	return 0;
+}
+
 int FBCmd::parser(char *p)
 {
 	if (p)
@@ -187,11 +620,11 @@ int FBCmd::parser(char *p)
 
 int FBCmd::run(CmdCtx *ctx)
 {
-	BulkTrans dev{m_timeout};
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::bulk, m_timeout);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	FastBoot fb(&dev);
+	FastBoot fb(dev.get(), ctx);
 	string cmd;
 	cmd = m_fb_cmd;
 	cmd += m_separator;
@@ -203,13 +636,118 @@ int FBCmd::run(CmdCtx *ctx)
 	return 0;
 }
 
+/* u-boot commands that only set up state and give the same result when run twice */
+static const char * const g_batch_ucmd[] = {
+	"setenv ", "env set ", "mmc dev ", "mmc rescan", "echo ",
+};
+
+/* keep the joined command well within the u-boot fastboot command buffer */
+static const size_t g_batch_ucmd_max = 512;
+
+bool FBUCmd::batchable() const
+{
+	string prot = str_to_upper(m_cmd.substr(0, m_cmd.find_first_of(":[")));
+	if (prot != "FB" && prot != "FASTBOOT")
+		return false;
+
+	/* no shell syntax, it would change meaning once joined */
+	if (m_uboot_cmd.find_first_of(";&|\n") != string::npos)
+		return false;
+
+	for (auto prefix : g_batch_ucmd)
+		if (m_uboot_cmd.compare(0, strlen(prefix), prefix) == 0)
+			return true;
+
+	return false;
+}
+
+string FBUCmd::env_name() const
+{
+	size_t pos = 0;
+	string s = get_next_param(m_uboot_cmd, pos);
+	if (s == "env")
+		s = get_next_param(m_uboot_cmd, pos);
+	if (s != "setenv" && s != "set")
+		return string();
+	return get_next_param(m_uboot_cmd, pos);
+}
+
+size_t FBUCmd::batch_size(CmdList::const_iterator begin, CmdList::const_iterator end)
+{
+	size_t count = 0;
+	size_t len = strlen("UCmd:");
+	vector<string> names;
+
+	for (auto it = begin; it != end; it++, count++)
+	{
+		auto cmd = dynamic_cast<const FBUCmd *>(it->get());
+		if (!cmd || !cmd->batchable())
+			break;
+
+		len += cmd->m_uboot_cmd.size() + strlen(" && ");
+		if (len > g_batch_ucmd_max)
+			break;
+
+		/* u-boot may expand all variables of the line before running any command of it */
+		bool uses_name = false;
+		for (auto &n : names)
+			if (cmd->m_uboot_cmd.find("$" + n) != string::npos || cmd->m_uboot_cmd.find("${" + n + "}") != string::npos)
+				uses_name = true;
+		if (uses_name)
+			break;
+
+		string n = cmd->env_name();
+		if (!n.empty())
+			names.push_back(n);
+	}
+
+	return count > 1 ? count : 0;
+}
+
+int FBUCmd::run_batch(CmdCtx *ctx, CmdList::const_iterator begin, size_t count)
+{
+	int timeout = 0;
+	string cmd = "UCmd:";
+	for (size_t i = 0; i < count; i++, begin++)
+	{
+		auto p = static_cast<const FBUCmd *>(begin->get());
+		if (i)
+			cmd += " && ";
+		cmd += p->m_uboot_cmd;
+		timeout = max(timeout, p->m_timeout);
+	}
+
+	auto dev = create_trans(TransType::bulk, timeout);
+	if (dev->open(ctx->m_dev))
+		return -1;
+
+	FastBoot fb(dev.get(), ctx);
+
+	/*
+	 * u-boot's simple parser passes "&&" to the first command as arguments
+	 * and runs nothing else. Only hush gets "false || true" right.
+	 */
+	if (ctx->m_fb_hush < 0)
+	{
+		fb.m_quiet = true;
+		ctx->m_fb_hush = fb.Transport("UCmd:false || true", nullptr, 0) == 0;
+		fb.m_quiet = false;
+		fb.m_info.clear();
+		fb.m_info_lines.clear();
+	}
+	if (!ctx->m_fb_hush)
+		return -1;
+
+	return fb.Transport(cmd, nullptr, 0) ? -1 : 0;
+}
+
 int FBPartNumber::run(CmdCtx *ctx)
 {
-	BulkTrans dev{m_timeout};
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::bulk, m_timeout);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	FastBoot fb(&dev);
+	FastBoot fb(dev.get(), ctx);
 
 	string_ex cmd;
 	cmd.format("%s:%s:%08x", m_fb_cmd.c_str(), m_partition_name.c_str(), (uint32_t)m_Size);
@@ -222,11 +760,11 @@ int FBPartNumber::run(CmdCtx *ctx)
 
 int FBUpdateSuper::run(CmdCtx *ctx)
 {
-	BulkTrans dev{m_timeout};
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::bulk, m_timeout);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	FastBoot fb(&dev);
+	FastBoot fb(dev.get(), ctx);
 
 	string_ex cmd;
 	cmd.format("%s:%s:%s", m_fb_cmd.c_str(), m_partition_name.c_str(), m_opt.c_str());
@@ -239,23 +777,20 @@ int FBUpdateSuper::run(CmdCtx *ctx)
 
 int FBDownload::run(CmdCtx *ctx)
 {
-	BulkTrans dev;
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::bulk, 2000);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	FastBoot fb(&dev);
+	FastBoot fb(dev.get(), ctx);
 
-	shared_ptr<FileBuffer> buff = get_file_buffer(m_filename);
+	shared_ptr<FileBuffer> buff = get_file_buffer(m_filename, true);
 	if (buff == nullptr)
 		return -1;
 
-	shared_ptr<DataBuffer> pdata = buff->request_data(0, SIZE_MAX);
-	if (!pdata)
-		return -1;
 	string_ex cmd;
-	cmd.format("download:%08x", pdata->size());
+	cmd.format("download:%08x", buff->size());
 
-	if (fb.Transport(cmd, pdata->data(), pdata->size()))
+	if (fb.Transport(cmd, buff, 0, buff->size()))
 		return -1;
 
 	return 0;
@@ -263,11 +798,11 @@ int FBDownload::run(CmdCtx *ctx)
 
 int FBUpload::run(CmdCtx* ctx)
 {
-	BulkTrans dev;
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::bulk, 2000);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	FastBoot fb(&dev);
+	FastBoot fb(dev.get(), ctx);
 	
 	string_ex cmd;
 	if (m_var.length())
@@ -275,16 +810,14 @@ int FBUpload::run(CmdCtx* ctx)
 	else
 		cmd.format("upload");
 
-	std::vector<uint8_t> buff;
-	if (fb.Transport(cmd, nullptr, buff.size(), &buff))
+	FileSink sink;
+	if (sink.open(m_filename))
 		return -1;
 
-	std::ofstream fout(m_filename, ios::out | ios::trunc | ios::binary);
-	std::copy(buff.begin(), buff.end(), std::ostream_iterator<uint8_t>(fout));
-	fout.flush();
-	fout.close();
+	if (fb.Transport(cmd, &sink))
+		return -1;
 
-	return 0;
+	return sink.close();
 }
 
 int FBCopy::parser(char *p)
@@ -352,24 +885,28 @@ int FBCopy::parser(char *p)
 
 int FBCopy::run(CmdCtx *ctx)
 {
-	BulkTrans dev;
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::bulk, 2000);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	FastBoot fb(&dev);
+	FastBoot fb(dev.get(), ctx);
 	string_ex cmd;
 
 	if(m_bDownload)
 	{
-		size_t i;
-		shared_ptr<FileBuffer> pin = get_file_buffer(m_local_file);
+		size_t i = 0;
+		shared_ptr<FileBuffer> pin = get_file_buffer(m_local_file, true);
 		if (pin == nullptr)
 		{
 			return -1;
 		}
-		shared_ptr<DataBuffer> buff = pin->request_data(0, SIZE_MAX);
-		if (!buff)
-			return -1;
+
+		/* use the largest command the target accepts, old targets keep 64K */
+		size_t each = m_Maxsize_pre_cmd;
+		string val;
+		if (!FBGetVar::get(ctx, "max-download-size", val, true) && !val.empty())
+			each = std::min(std::max(each, (size_t)str_to_uint64(val)), m_Maxsize_limit);
+
 		cmd.format("WOpen:%s", m_target_file.c_str());
 		if (fb.Transport(cmd, nullptr, 0))
 		{
@@ -390,20 +927,75 @@ int FBCopy::run(CmdCtx *ctx)
 			}
 		}
 
+		bool bload = pin->IsKnownSize();
 		uuu_notify nt;
 		nt.type = uuu_notify::NOTIFY_TRANS_SIZE;
-		nt.total = buff->size();
+		nt.total = bload ? pin->size() : 0;
 		call_notify(nt);
 
-		for (i = 0; i < buff->size(); i += this->m_Maxsize_pre_cmd)
+		/* one reader thread reads the next chunk while the current one is on the wire */
+		deque<shared_ptr<DataBuffer>> ready;
+		mutex lock;
+		condition_variable cv;
+		bool stop = false;
+		bool read_err = false;
+
+		thread reader([&] {
+			size_t pos = 0;
+			while (true)
+			{
+				{
+					unique_lock<mutex> l(lock);
+					cv.wait(l, [&] { return stop || ready.empty(); });
+					if (stop)
+						break;
+				}
+
+				shared_ptr<DataBuffer> b;
+				try {
+					b = pin->request_data(pos, each);
+				} catch (const std::exception &e) {
+					set_last_err_string(e.what());
+					read_err = true;
+				}
+
+				lock_guard<mutex> l(lock);
+				ready.push_back(b);
+				cv.notify_all();
+				if (!b || !b->size())
+					break;
+				pos += b->size();
+			}
+		});
+
+		auto stop_reader = [&] {
+			{
+				lock_guard<mutex> l(lock);
+				stop = true;
+			}
+			cv.notify_all();
+			reader.join();
+		};
+
+		while (true)
 		{
-			size_t sz = buff->size() - i;
-			if (sz > m_Maxsize_pre_cmd)
-				sz = m_Maxsize_pre_cmd;
+			shared_ptr<DataBuffer> buff;
+			{
+				unique_lock<mutex> l(lock);
+				cv.wait(l, [&] { return !ready.empty(); });
+				buff = ready.front();
+				ready.pop_front();
+			}
+			cv.notify_all();
 
-			cmd.format("donwload:%08X", sz);
-			if (fb.Transport(cmd, buff->data() + i, sz))
+			if (!buff || !buff->size())
+				break;
+
+			cmd.format("donwload:%08X", buff->size());
+			if (fb.Transport(cmd, buff->data(), buff->size()))
 			{
+				stop_reader();
+
 				if (fb.m_info == "EPIPE")
 					set_last_err_string("pipe closed by target");
 				else
@@ -416,14 +1008,35 @@ int FBCopy::run(CmdCtx *ctx)
 				return -1;
 			}
 
+			if (bload != pin->IsKnownSize())
+			{
+				nt.type = uuu_notify::NOTIFY_TRANS_SIZE;
+				nt.total = pin->size();
+				call_notify(nt);
+				bload = pin->IsKnownSize();
+			}
+
+			i += buff->size();
 			nt.type = uuu_notify::NOTIFY_TRANS_POS;
 			nt.index = i;
 			call_notify(nt);
 		}
+		stop_reader();
 
-		nt.type = uuu_notify::NOTIFY_TRANS_POS;
-		nt.index = buff->size();
-		call_notify(nt);
+		if (read_err)
+		{
+			cmd.format("Close");
+			fb.Transport(cmd, nullptr, 0);
+			return -1;
+		}
+
+		if (!pin->IsKnownSize() || i != pin->size())
+		{
+			set_last_err_string("some data missed");
+			cmd.format("Close");
+			fb.Transport(cmd, nullptr, 0);
+			return -1;
+		}
 	}
 	else
 	{
@@ -437,7 +1050,6 @@ int FBCopy::run(CmdCtx *ctx)
 		call_notify(nt);
 
 		nt.index = 0;
-		ofstream of;
 
 		struct stat st;
 
@@ -455,32 +1067,31 @@ int FBCopy::run(CmdCtx *ctx)
 			}
 		}
 
-		of.open(localfile, ofstream::binary);
+		FileSink sink;
+		if (sink.open(localfile))
+			return -1;
+		sink.reserve(total);
 
-		if (!of)
-		{
-			string err;
-			err = "Fail to open file";
-			err += localfile;
-			set_last_err_string(err);
-		}
 		do
 		{
-			vector<uint8_t> data;
-			if (fb.Transport("upload", nullptr, 0, &data))
+			size_t received = sink.received();
+			if (fb.Transport("upload", &sink))
 				return -1;
 
-			of.write((const char*)data.data(), data.size());
+			received = sink.received() - received;
 
 			nt.type = uuu_notify::NOTIFY_TRANS_POS;
-			nt.index += data.size();
+			nt.index += received;
 			call_notify(nt);
 
-			if (data.size() == 0)
+			if (received == 0)
 				break;
 
 		} while (nt.index < total ||  total == 0 ); // If total is 0, it is stream
 
+		if (sink.close())
+			return -1;
+
 		nt.type = uuu_notify::NOTIFY_TRANS_POS;
 		call_notify(nt);
 	}
@@ -599,126 +1210,368 @@ int FBFlashCmd::parser(char *p)
 	return 0;
 }
 
-int FBFlashCmd::flash(FastBoot *fb, void * pdata, size_t sz)
+/*
+ * Build the next sparse chunks in a worker thread while the current one is
+ * downloaded and written by the device. The producer fills chunk() and
+ * calls push(); run() flashes the chunks in order in the calling thread,
+ * so notifications still come from the device's thread. The chunks are
+ * heap memory, the producer never touches the transport.
+ */
+class SparsePipeline
 {
-	string_ex cmd;
-	cmd.format("download:%08x", sz);
-
-	if (fb->Transport(cmd, pdata, sz))
-		return -1;
-
-	cmd.format("flash:%s", m_partition.c_str());
-	if (fb->Transport(cmd, nullptr, 0))
-		return -1;
+public:
+	struct Chunk
+	{
+		SparseFile sf;
+		size_t pos = 0;		/* NOTIFY_TRANS_POS once this chunk is flashed */
+		bool resize = false;	/* NOTIFY_TRANS_SIZE with total first */
+		size_t total = 0;
+	};
 
-	return 0;
-}
+	SparsePipeline(size_t depth = 2) : m_depth{depth}, m_building{new Chunk} {}
 
-int FBFlashCmd::flash_raw2sparse(FastBoot *fb, shared_ptr<FileBuffer> pdata, size_t max)
-{
-	SparseFile sf;
+	Chunk & chunk() { return *m_building; }
 
-	vector<uint8_t> data;
+	/* queue chunk() and start an empty one, false if the consumer stopped */
+	bool push()
+	{
+		unique_ptr<Chunk> next;
+		{
+			unique_lock<mutex> lock(m_lock);
+			m_cv.wait(lock, [this] { return m_stop || m_queue.size() < m_depth; });
+			if (m_stop)
+				return false;
 
-	if (max > m_sparse_limit)
-		 max = m_sparse_limit;
+			m_queue.push_back(std::move(m_building));
+			if (!m_free.empty())
+			{
+				next = std::move(m_free.back());
+				m_free.pop_back();
+			}
+		}
+		m_cv.notify_all();
 
-	size_t block_size = m_bmap.block_size();
+		m_building = next ? std::move(next) : unique_ptr<Chunk>(new Chunk);
+		m_building->resize = false;
+		return true;
+	}
 
-	sf.init_header(m_bmap.block_size(), (max + block_size - 1) / block_size);
+	/* flash every chunk, then notify its progress */
+	int run(function<int()> producer, function<int(SparseFile &)> flash)
+	{
+		int produced = 0;
+		thread worker([&] {
+			try {
+				produced = producer();
+			} catch (const std::exception &e) {
+				set_last_err_string(e.what());
+				produced = -1;
+			}
+			lock_guard<mutex> lock(m_lock);
+			m_done = true;
+			m_cv.notify_all();
+		});
 
-	data.resize(block_size);
+		int ret = 0;
+		while (!ret)
+		{
+			unique_ptr<Chunk> c;
+			{
+				unique_lock<mutex> lock(m_lock);
+				m_cv.wait(lock, [this] { return m_done || !m_queue.empty(); });
+				if (m_queue.empty())
+					break;
+				c = std::move(m_queue.front());
+				m_queue.pop_front();
+			}
+			m_cv.notify_all();
 
-	uuu_notify nt;
-	bool bload = pdata->IsKnownSize();
+			ret = flash(c->sf);
+			if (!ret)
+				notify(*c);
 
-	nt.type = uuu_notify::NOTIFY_TRANS_SIZE;
-	if (bload)
-		nt.total = pdata->size();
-	else
-		nt.total = 0;
+			lock_guard<mutex> lock(m_lock);
+			m_free.push_back(std::move(c));
+			if (ret)
+			{
+				m_stop = true;
+				m_cv.notify_all();
+			}
+		}
 
-	call_notify(nt);
-	
-	size_t i = 0;
-	int r;
-	while (!(r=pdata->request_data(data, i*block_size, block_size)))
+		worker.join();
+		return ret ? ret : produced;
+	}
+
+private:
+	static void notify(const Chunk &c)
 	{
-		int ret = sf.push_one_block(data.data(), !m_bmap.is_mapped_block(i));
-		if (ret)
+		uuu_notify nt;
+		if (c.resize)
 		{
-			if (flash(fb, sf.m_data.data(), sf.m_data.size()))
-				return -1;
+			nt.type = uuu_notify::NOTIFY_TRANS_SIZE;
+			nt.total = c.total;
+			call_notify(nt);
+		}
 
-			sf.init_header(block_size, (max + block_size - 1) / block_size);
+		nt.type = uuu_notify::NOTIFY_TRANS_POS;
+		nt.total = c.pos;
+		call_notify(nt);
+	}
 
-			chunk_header_t ct;
-			ct.chunk_type = CHUNK_TYPE_DONT_CARE;
-			ct.chunk_sz = i + 1;
-			ct.reserved1 = 0;
-			ct.total_sz = sizeof(ct);
+	const size_t m_depth;
+	unique_ptr<Chunk> m_building;
+	deque<unique_ptr<Chunk>> m_queue;
+	vector<unique_ptr<Chunk>> m_free;
+	mutex m_lock;
+	condition_variable m_cv;
+	bool m_stop = false;
+	bool m_done = false;
+};
 
-			sf.push_one_chuck(&ct, nullptr);
+/*
+ * Walk the chunks of a sparse image in one pass. The file is read in
+ * windows of several chunks, and each chunk's payload points into its
+ * window, so re-splitting only references it.
+ */
+class SparseReader
+{
+public:
+	struct Chunk
+	{
+		chunk_header_t header;
+		size_t block = 0;		/* first output block */
+		uint8_t *data = nullptr;	/* payload, kept alive by owner */
+		shared_ptr<DataBuffer> owner;
+	};
 
-			nt.type = uuu_notify::NOTIFY_TRANS_POS;
-			nt.total = i * block_size;
-			call_notify(nt);
+	SparseReader(shared_ptr<FileBuffer> p, size_t window = 0x400000) : m_file{p}, m_window{window} {}
+
+	int open()
+	{
+		if (m_file->request_data(&m_header, 0, sizeof(m_header)) != sizeof(m_header)
+			|| !SparseFile::is_validate_sparse_file(&m_header, sizeof(m_header)))
+		{
+			set_last_err_string("Sparse file magic miss matched");
+			return -1;
 		}
+		m_pos = m_header.file_hdr_sz;
+		return 0;
+	}
+
+	const sparse_header & header() const noexcept { return m_header; }
+
+	/* 1 with the next chunk in c, 0 after the last chunk */
+	int next(Chunk &c)
+	{
+		if (m_chunk == m_header.total_chunks)
+			return 0;
 
-		i++;
+		uint8_t *p = get(m_pos, sizeof(chunk_header_t));
+		if (p == nullptr)
+			return -1;
+		memcpy(&c.header, p, sizeof(chunk_header_t));
 
-		if (bload != pdata->IsKnownSize())
+		if (c.header.total_sz < sizeof(chunk_header_t))
 		{
-			nt.type = uuu_notify::NOTIFY_TRANS_SIZE;
-			nt.total = pdata->size();
-			call_notify(nt);
+			set_last_err_string("Sparse chunk size is wrong");
+			return -1;
+		}
+
+		p = get(m_pos, c.header.total_sz);
+		if (p == nullptr)
+			return -1;
+
+		c.data = p + sizeof(chunk_header_t);
+		c.owner = m_buff;
+		c.block = m_block;
+
+		m_pos += c.header.total_sz;
+		m_block += c.header.chunk_sz;
+		m_chunk++;
+		return 1;
+	}
 
-			bload = pdata->IsKnownSize();
+private:
+	/* sz bytes at off, from the current window or a new one starting at off */
+	uint8_t * get(size_t off, size_t sz)
+	{
+		if (!m_buff || off < m_buff_off || off + sz > m_buff_off + m_buff->size())
+		{
+			m_buff = m_file->request_data(off, max(sz, m_window));
+			m_buff_off = off;
+			if (!m_buff || m_buff->size() < sz)
+			{
+				m_buff.reset();
+				set_last_err_string("Sparse file is truncated");
+				return nullptr;
+			}
 		}
+		return m_buff->data() + off - m_buff_off;
 	}
 
-	if (r == ERR_OUT_MEMORY)
-		return r;
+	shared_ptr<FileBuffer> m_file;
+	size_t m_window;
+	sparse_header m_header;
+
+	shared_ptr<DataBuffer> m_buff;
+	size_t m_buff_off = 0;
+
+	size_t m_pos = 0;
+	size_t m_block = 0;
+	size_t m_chunk = 0;
+};
+
+int FBFlashCmd::flash(FastBoot *fb, void * pdata, size_t sz)
+{
+	return flash(fb, vector<TransSegment>{ { pdata, sz } });
+}
+
+int FBFlashCmd::flash(FastBoot *fb, const vector<TransSegment> &data)
+{
+	size_t sz = 0;
+	for (auto &seg : data)
+		sz += seg.size;
+
+	string_ex cmd;
+	cmd.format("download:%08x", sz);
+
+	if (fb->Transport(cmd, data))
+		return -1;
+
+	cmd.format("flash:%s", m_partition.c_str());
+	if (fb->Transport(cmd, nullptr, 0))
+		return -1;
+
+	return 0;
+}
 
-	if (flash(fb, sf.m_data.data(), sf.m_data.size()))
+int FBFlashCmd::flash(FastBoot *fb, shared_ptr<FileBuffer> p, size_t offset, size_t sz)
+{
+	string_ex cmd;
+	cmd.format("download:%08x", sz);
+
+	if (fb->Transport(cmd, p, offset, sz))
 		return -1;
 
+	cmd.format("flash:%s", m_partition.c_str());
+	if (fb->Transport(cmd, nullptr, 0))
+		return -1;
+
+	return 0;
+}
+
+/* raw2sparse reads the image in windows of this size */
+static const size_t g_raw2sparse_window = 0x100000;
+
+int FBFlashCmd::flash_raw2sparse(FastBoot *fb, shared_ptr<FileBuffer> pdata, size_t max)
+{
+	SparsePipeline pipe;
+
+	if (max > m_sparse_limit)
+		 max = m_sparse_limit;
+
+	size_t block_size = m_bmap.block_size();
+
+	pipe.chunk().sf.init_header(m_bmap.block_size(), (max + block_size - 1) / block_size);
+
+	uuu_notify nt;
+	bool bload = pdata->IsKnownSize();
+
 	nt.type = uuu_notify::NOTIFY_TRANS_SIZE;
-	nt.total = pdata->size();
-	call_notify(nt);
+	if (bload)
+		nt.total = pdata->size();
+	else
+		nt.total = 0;
 
-	nt.type = uuu_notify::NOTIFY_TRANS_POS;
-	nt.total = pdata->size();
 	call_notify(nt);
 
-	return 0;
+	auto produce = [&]() -> int {
+		/* read and scan a window of blocks at a time, not block by block */
+		size_t window = std::max(block_size, g_raw2sparse_window / block_size * block_size);
+		vector<uint8_t> tail;
+
+		size_t i = 0;
+		for (;;)
+		{
+			/* referenced by the sparse image until it is flashed */
+			shared_ptr<DataBuffer> data = pdata->request_data(i*block_size, window);
+			if (!data || !data->size())
+				break;
+
+			size_t blocks = (data->size() + block_size - 1) / block_size;
+			for (size_t b = 0; b < blocks; b++, i++)
+			{
+				uint8_t *p = data->data() + b * block_size;
+				shared_ptr<void> owner = data;
+				if ((b + 1) * block_size > data->size())
+				{
+					/* pad the last partial block */
+					tail.assign(p, data->data() + data->size());
+					tail.resize(block_size, 0);
+					p = tail.data();
+					owner = nullptr;
+				}
+
+				int ret = pipe.chunk().sf.push_one_block(p, !m_bmap.is_mapped_block(i), owner);
+				if (ret)
+				{
+					pipe.chunk().pos = i * block_size;
+					if (!pipe.push())
+						return -1;
+
+					SparseFile &sf = pipe.chunk().sf;
+					sf.init_header(block_size, (max + block_size - 1) / block_size);
+
+					chunk_header_t ct;
+					ct.chunk_type = CHUNK_TYPE_DONT_CARE;
+					ct.chunk_sz = i + 1;
+					ct.reserved1 = 0;
+					ct.total_sz = sizeof(ct);
+
+					sf.push_one_chuck(&ct, nullptr);
+				}
+			}
+
+			if (bload != pdata->IsKnownSize())
+			{
+				pipe.chunk().resize = true;
+				pipe.chunk().total = pdata->size();
+
+				bload = pdata->IsKnownSize();
+			}
+		}
+
+		pipe.chunk().resize = true;
+		pipe.chunk().total = pdata->size();
+		pipe.chunk().pos = pdata->size();
+		return pipe.push() ? 0 : -1;
+	};
+
+	return pipe.run(produce, [&](SparseFile &sf) { return flash(fb, sf.segments()); });
 }
 
 int FBFlashCmd::run(CmdCtx *ctx)
 {
-	FBGetVar getvar((char*)"FB: getvar max-download-size");
-	if (getvar.parser(nullptr))
-		return -1;
-	if (getvar.run(ctx))
+	string val;
+	if (FBGetVar::get(ctx, "max-download-size", val))
 		return -1;
 
-	size_t max = getvar.m_val.empty() ? m_sparse_limit : str_to_uint32(getvar.m_val);
+	size_t max = val.empty() ? m_sparse_limit : str_to_uint32(val);
 
-	BulkTrans dev{m_timeout};
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::bulk, m_timeout);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	FastBoot fb(&dev);
+	FastBoot fb(dev.get(), ctx);
 
 	if (m_raw2sparse)
 	{
 		// fully mapped image
 		if (!m_use_bmap) {
 			size_t block_size = 4096;
-			if (getvar.parser((char*)"FB: getvar logical-block-size"))
-				return -1;
-			if (!getvar.run(ctx))
-				block_size = str_to_uint32(getvar.m_val);
+			if (!FBGetVar::get(ctx, "logical-block-size", val))
+				block_size = str_to_uint32(val);
 
 			if (block_size == 0) {
 				set_last_err_string("Device report block_size is 0");
@@ -739,19 +1592,12 @@ int FBFlashCmd::run(CmdCtx *ctx)
 
 		if (isffu(pdata))
 		{
-			string str;
-			str = "FB: getvar partition-size:";
-			str += m_partition;
-
-			if (getvar.parser((char*)str.c_str()))
-				return -1;
-
-			if (getvar.run(ctx))
+			if (FBGetVar::get(ctx, "partition-size:" + m_partition, val))
 				return -1;
 
-			m_totalsize = str_to_uint64(getvar.m_val);
+			m_totalsize = str_to_uint64(val);
 
-			return flash_ffu(&fb, pdata);
+			return flash_ffu(&fb, pdata, max);
 		}
 
 		return flash_raw2sparse(&fb, pdata, max);
@@ -797,65 +1643,38 @@ int FBFlashCmd::run(CmdCtx *ctx)
 
 	if (pin->size() <= max)
 	{
-		pb = pin->request_data(0, pin->size());
-		if (!pb)
-			return -1;
-
-		if (flash(&fb, pb->data(), pb->size()))
+		if (flash(&fb, pin, 0, pin->size()))
 			return -1;
 	}
 	else
 	{
-		size_t pos = 0;
-		pb = pin->request_data(0, sizeof(sparse_header));
-		if (!pb)
+		SparseReader reader(pin);
+		if (reader.open())
 			return -1;
-		sparse_header * pfile = (sparse_header *)pb->data();
+		const sparse_header *pfile = &reader.header();
 
-		if (!SparseFile::is_validate_sparse_file(pb->data(), sizeof(sparse_header)))
-		{
-			set_last_err_string("Sparse file magic miss matched");
-			return -1;
-		}
-
-		SparseFile sf;
+		SparsePipeline pipe;
 		size_t startblock;
-		chunk_header_t * pheader;
 
 		uuu_notify nt;
 		nt.type = uuu_notify::NOTIFY_TRANS_SIZE;
 		nt.total = pfile->total_blks;
 		call_notify(nt);
 
-		sf.init_header(pfile->blk_sz, max / pfile->blk_sz);
+		pipe.chunk().sf.init_header(pfile->blk_sz, max / pfile->blk_sz);
 		startblock = 0;
-		pos = pfile->file_hdr_sz;
 
-		for(size_t nblk=0; nblk < pfile->total_chunks && pos <= pin->size(); nblk++)
-		{
-			pb = pin->request_data(pos, sizeof(chunk_header_t));
-			if (!pb)
-				return -1;
-			pheader = (chunk_header_t*)pb->data();
-			size_t oldpos = pos;
-			pos += pheader->total_sz;
-			pb = pin->request_data(oldpos, pos - oldpos);
-			if (!pb)
-				return -1;
-			pheader = (chunk_header_t*)pb->data();
+		auto produce = [&]() -> int {
+			SparseFile *sf = &pipe.chunk().sf;
 
-			size_t sz = sf.push_one_chuck(pheader, pheader + 1);
-			if (sz == pheader->total_sz - sizeof(chunk_header_t))
-			{
-				startblock += pheader->chunk_sz;
-			}
-			else if (sz == 0)
-			{
-				//whole chuck have not push into data.
-				if (flash(&fb, sf.m_data.data(), sf.m_data.size()))
-					return -1;
+			/* queue the full chunk, the next one starts with the blocks done so far */
+			auto next_chunk = [&]() -> bool {
+				pipe.chunk().pos = startblock;
+				if (!pipe.push())
+					return false;
 
-				sf.init_header(pfile->blk_sz, max / pfile->blk_sz);
+				sf = &pipe.chunk().sf;
+				sf->init_header(pfile->blk_sz, max / pfile->blk_sz);
 
 				chunk_header_t ct;
 				ct.chunk_type = CHUNK_TYPE_DONT_CARE;
@@ -863,61 +1682,59 @@ int FBFlashCmd::run(CmdCtx *ctx)
 				ct.reserved1 = 0;
 				ct.total_sz = sizeof(ct);
 
-				sz = sf.push_one_chuck(&ct, nullptr);
+				sf->push_one_chuck(&ct, nullptr);
+				return true;
+			};
 
-				/*
-					roll back pos to previous failure chunck and let it push again into new sparse file.
-					can't push it here because next chuck may big size chuck and need split as below else logic.
-				*/
-				pos = oldpos;
-				nblk--;
-
-				uuu_notify nt;
-				nt.type = uuu_notify::NOTIFY_TRANS_POS;
-				nt.total = startblock;
-				call_notify(nt);
-			}
-			else
+			SparseReader::Chunk c;
+			int ret;
+			while ((ret = reader.next(c)) > 0)
 			{
-				size_t off = sz + sizeof(chunk_header_t);
-				startblock += sz / pfile->blk_sz;
-
-				do
+				size_t payload = c.header.total_sz - sizeof(chunk_header_t);
+				size_t before = sf->size();
+				size_t sz = sf->push_one_chuck(&c.header, c.data, c.owner);
+				if (sf->size() == before)
 				{
-					if (flash(&fb, sf.m_data.data(), sf.m_data.size()))
+					/* whole chunk does not fit, start a new image with it */
+					if (!next_chunk())
 						return -1;
+					sz = sf->push_one_chuck(&c.header, c.data, c.owner);
+				}
 
-					sf.init_header(pfile->blk_sz, max / pfile->blk_sz);
-
-					chunk_header_t ct;
-					ct.chunk_type = CHUNK_TYPE_DONT_CARE;
-					ct.chunk_sz = startblock;
-					ct.reserved1 = 0;
-					ct.total_sz = sizeof(ct);
+				if (sz == payload)
+				{
+					startblock = c.block + c.header.chunk_sz;
+					continue;
+				}
 
-					sz = sf.push_one_chuck(&ct, nullptr);
+				/* split a big raw chunk over the following images */
+				size_t off = sz;
+				startblock = c.block + off / pfile->blk_sz;
+				while (off < payload)
+				{
+					if (!next_chunk())
+						return -1;
 
-					sz = sf.push_raw_data(pb->data() + off, pb->size() - off);
+					sz = sf->push_raw_data(c.data + off, payload - off, c.owner);
+					if (sz == 0)
+					{
+						set_last_err_string("sparse chunk is bigger than max-download-size");
+						return -1;
+					}
 					off += sz;
-					startblock += sz / pfile->blk_sz;
-
-					uuu_notify nt;
-					nt.type = uuu_notify::NOTIFY_TRANS_POS;
-					nt.total = startblock;
-					call_notify(nt);
-
-				} while (off + oldpos < pos);
+					startblock = c.block + off / pfile->blk_sz;
+				}
 			}
-		}
+			if (ret < 0)
+				return -1;
 
-		//send last data
-		if (flash(&fb, sf.m_data.data(), sf.m_data.size()))
-			return -1;
+			//send last data
+			sparse_header * pf = (sparse_header *)sf->m_data.data();
+			pipe.chunk().pos = startblock + pf->total_blks;
+			return pipe.push() ? 0 : -1;
+		};
 
-		sparse_header * pf = (sparse_header *)sf.m_data.data();
-		nt.type = uuu_notify::NOTIFY_TRANS_POS;
-		nt.total = startblock + pf->total_blks;
-		call_notify(nt);
+		return pipe.run(produce, [&](SparseFile &sf) { return flash(&fb, sf.segments()); });
 	}
 	return 0;
 }
@@ -935,31 +1752,7 @@ bool FBFlashCmd::isffu(shared_ptr<FileBuffer> p)
 		return false;
 }
 
-int FBFlashCmd::flash_ffu_oneblk(FastBoot *fb, shared_ptr<FileBuffer> pin, size_t off, size_t blksz, size_t blkindex)
-{
-	SparseFile sf;
-
-	sf.init_header(blksz, 10);
-	
-	shared_ptr<DataBuffer> p;
-	p = pin->request_data(off, blksz);
-	if (!p)
-		return -1;
-	chunk_header_t ct;
-	ct.chunk_type = CHUNK_TYPE_DONT_CARE;
-	ct.chunk_sz = blkindex;
-	ct.reserved1 = 0;
-	ct.total_sz = sizeof(ct);
-
-	sf.push_one_chuck(&ct, nullptr);
-
-	if (sf.push_one_block(p->data()))
-		return -1;
-
-	return flash(fb, sf.m_data.data(), sf.m_data.size());
-}
-
-int FBFlashCmd::flash_ffu(FastBoot *fb, shared_ptr<FileBuffer> pin)
+int FBFlashCmd::flash_ffu(FastBoot *fb, shared_ptr<FileBuffer> pin, size_t max)
 {
 	shared_ptr<DataBuffer> p = pin->request_data(0, sizeof(FFU_SECURITY_HEADER));
 	if (!p)
@@ -1004,14 +1797,17 @@ int FBFlashCmd::flash_ffu(FastBoot *fb, shared_ptr<FileBuffer> pin)
 	size_t block_off = off + pIs->dwWriteDescriptorLength;
 	block_off = round_up(block_off, (size_t)h->dwChunkSizeInKb * 1024);
 
-	uuu_notify nt;
-	nt.type = uuu_notify::NOTIFY_TRANS_SIZE;
-	nt.total = pIs->dwWriteDescriptorCount;
-	call_notify(nt);
+	/* disk block and offset of its data in the file, in write order */
+	struct FFUBlock
+	{
+		uint64_t target;
+		size_t off;
+	};
+	vector<FFUBlock> blocks;
+	size_t blksz = pIs->dwBlockSizeInBytes;
 
 	size_t current_block = 0;
-	size_t i;
-	for (i = 0; i < pIs->dwWriteDescriptorCount; i++)
+	for (size_t i = 0; i < pIs->dwWriteDescriptorCount; i++)
 	{
 		FFU_BLOCK_DATA_ENTRY *entry = (FFU_BLOCK_DATA_ENTRY*)(p->data() + off);
 
@@ -1025,37 +1821,91 @@ int FBFlashCmd::flash_ffu(FastBoot *fb, shared_ptr<FileBuffer> pin)
 		{
 			for (uint32_t loc = 0; loc < entry->dwLocationCount; loc++)
 			{
-				//printf("block 0x%x write to 0x%x seek %d\n", current_block, entry->rgDiskLocations[loc].dwBlockIndex, entry->rgDiskLocations[loc].dwDiskAccessMethod);
-				uint32_t blockindex;
+				uint64_t blockindex;
 				if (entry->rgDiskLocations[loc].dwDiskAccessMethod == DISK_BEGIN)
 					blockindex = entry->rgDiskLocations[loc].dwBlockIndex;
 				else
-					blockindex = m_totalsize / pIs->dwBlockSizeInBytes - 1 - entry->rgDiskLocations[loc].dwBlockIndex;
+					blockindex = m_totalsize / blksz - 1 - entry->rgDiskLocations[loc].dwBlockIndex;
 
 				for (uint32_t blk = 0; blk < entry->dwBlockCount; blk++)
-				{
-					if (flash_ffu_oneblk(fb,
-							pin,
-							block_off + (current_block + blk) * pIs->dwBlockSizeInBytes,
-							pIs->dwBlockSizeInBytes,
-							blockindex + blk))
-						return -1;
-				}
+					blocks.push_back({ blockindex + blk, block_off + (current_block + blk) * blksz });
 			}
 		}
 
-		nt.type = uuu_notify::NOTIFY_TRANS_POS;
-		nt.total = i;
-		call_notify(nt);
-
 		current_block += entry->dwBlockCount;
 	}
 
-	nt.type = uuu_notify::NOTIFY_TRANS_POS;
-	nt.total = i;
+	/* a sparse image goes from low to high blocks, the last write to a block wins */
+	stable_sort(blocks.begin(), blocks.end(), [](const FFUBlock &a, const FFUBlock &b) { return a.target < b.target; });
+	size_t n = 0;
+	for (auto &b : blocks)
+	{
+		if (n && blocks[n - 1].target == b.target)
+			blocks[n - 1] = b;
+		else
+			blocks[n++] = b;
+	}
+	blocks.resize(n);
+
+	uuu_notify nt;
+	nt.type = uuu_notify::NOTIFY_TRANS_SIZE;
+	nt.total = blocks.size();
 	call_notify(nt);
 
-	return 0;
+	if (blocks.empty())
+		return 0;
+
+	if (max > m_sparse_limit)
+		max = m_sparse_limit;
+
+	/* fill each image up to max with the blocks, DONT_CARE for the gaps between them */
+	SparsePipeline pipe;
+
+	auto produce = [&]() -> int {
+		SparseFile *sf = &pipe.chunk().sf;
+		sf->init_header(blksz, max / blksz);
+		uint64_t next = 0;
+
+		for (size_t i = 0; i < blocks.size(); i++)
+		{
+			if (blocks[i].target > next)
+			{
+				chunk_header_t ct;
+				ct.chunk_type = CHUNK_TYPE_DONT_CARE;
+				ct.chunk_sz = blocks[i].target - next;
+				ct.reserved1 = 0;
+				ct.total_sz = sizeof(ct);
+
+				sf->push_one_chuck(&ct, nullptr);
+			}
+
+			shared_ptr<DataBuffer> data = pin->request_data(blocks[i].off, blksz);
+			if (!data || data->size() < blksz)
+			{
+				set_last_err_string("FFU block data out of file");
+				return -1;
+			}
+
+			int full = sf->push_one_block(data->data(), false, data);
+			next = blocks[i].target + 1;
+
+			if (full && i + 1 < blocks.size())
+			{
+				pipe.chunk().pos = i + 1;
+				if (!pipe.push())
+					return -1;
+
+				sf = &pipe.chunk().sf;
+				sf->init_header(blksz, max / blksz);
+				next = 0;
+			}
+		}
+
+		pipe.chunk().pos = blocks.size();
+		return pipe.push() ? 0 : -1;
+	};
+
+	return pipe.run(produce, [&](SparseFile &sf) { return flash(fb, sf.segments()); });
 }
 
 FBLoop::FBLoop(char* p): CmdBase(p)
@@ -1067,6 +1917,7 @@ FBLoop::FBLoop(char* p): CmdBase(p)
 	insert_param_info("-seek", &m_seek, Param::Type::e_uint32);
 	insert_param_info("-skip", &m_skip, Param::Type::e_uint32);
 	insert_param_info("-nostop", &m_nostop, Param::Type::e_bool);
+	insert_param_info("-prefetch", &m_prefetch, Param::Type::e_uint32);
 }
 
 string FBLoop::build_cmd(string& cmd, size_t off, size_t sz)
@@ -1093,22 +1944,20 @@ string FBLoop::build_cmd(string& cmd, size_t off, size_t sz)
 
 int FBLoop::run(CmdCtx* ctx)
 {
-	BulkTrans dev{ m_timeout };
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::bulk, m_timeout);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
 	int ret = 0;
 	string_ex err;
 	size_t offset = 0;
 	size_t seek = 0;
-	FastBoot fb(&dev);
+	FastBoot fb(dev.get(), ctx);
 	string_ex cmd;
 	shared_ptr<FileBuffer> p1 = get_file_buffer(m_filename, true);
 	if (p1 == nullptr)
 		return 0;
 
-	shared_ptr<DataBuffer> fbuff;
-
 	bool bload = p1->IsKnownSize();
 	uuu_notify nt;
 	nt.type = uuu_notify::NOTIFY_TRANS_SIZE;
@@ -1121,14 +1970,83 @@ int FBLoop::run(CmdCtx* ctx)
 	offset = m_skip;
 	seek = m_seek;
 
-	while((fbuff = p1->request_data(offset, m_each)))
+	/* read and prepare the next chunks while the current one is sent */
+	deque<Chunk> queue;
+	size_t queued = 0;
+	mutex lock;
+	condition_variable cv;
+	bool done = false;
+	bool stop = false;
+
+	thread reader([&] {
+		size_t pos = offset;
+		while (true)
+		{
+			{
+				unique_lock<mutex> l(lock);
+				cv.wait(l, [&] { return stop || queue.empty() || queued + m_each <= m_prefetch; });
+				if (stop)
+					break;
+			}
+
+			Chunk c;
+			try {
+				c.data = p1->request_data(pos, m_each);
+				if (c.data)
+				{
+					pos += c.data->size();
+					prepare(c);
+				}
+			} catch (const std::exception &e) {
+				set_last_err_string(e.what());
+				c.data.reset();
+			}
+
+			lock_guard<mutex> l(lock);
+			if (!c.data)
+			{
+				done = true;
+				cv.notify_all();
+				break;
+			}
+			queued += c.data->size();
+			queue.push_back(std::move(c));
+			cv.notify_all();
+		}
+	});
+
+	auto stop_reader = [&] {
+		{
+			lock_guard<mutex> l(lock);
+			stop = true;
+		}
+		cv.notify_all();
+		reader.join();
+	};
+
+	while (true)
 	{
-		ret = this->each(fb, fbuff, seek);
-		offset += fbuff->size();
-		seek += fbuff->size();
+		Chunk c;
+		{
+			unique_lock<mutex> l(lock);
+			cv.wait(l, [&] { return done || !queue.empty(); });
+			if (queue.empty())
+				break;
+			c = std::move(queue.front());
+			queue.pop_front();
+			queued -= c.data->size();
+		}
+		cv.notify_all();
+
+		ret = this->each(fb, c, seek);
+		offset += c.data->size();
+		seek += c.data->size();
 
 		if (!m_nostop && ret)
+		{
+			stop_reader();
 			return ret;
+		}
 
 		nt.type = uuu_notify::NOTIFY_TRANS_POS;
 		nt.total = offset;
@@ -1143,6 +2061,7 @@ int FBLoop::run(CmdCtx* ctx)
 			bload = p1->IsKnownSize();
 		}
 	}
+	stop_reader();
 
 	if (!p1->IsKnownSize())
 	{
@@ -1162,9 +2081,14 @@ int FBLoop::run(CmdCtx* ctx)
 	return ret;
 }
 
-int FBCRC::each(FastBoot& fb, std::shared_ptr<DataBuffer> fbuff, size_t off)
+void FBCRC::prepare(Chunk &c)
+{
+	c.crc = crc32_parallel(0, c.data->data(), c.data->size());
+}
+
+int FBCRC::each(FastBoot& fb, const Chunk &c, size_t off)
 {
-	uint32_t crc = crc32(0, fbuff->data(), fbuff->size());
+	const shared_ptr<DataBuffer> &fbuff = c.data;
 
 	string cmd = build_cmd(m_uboot_cmd, off / m_blksize, div_round_up(fbuff->size(), m_blksize));
 
@@ -1172,7 +2096,7 @@ int FBCRC::each(FastBoot& fb, std::shared_ptr<DataBuffer> fbuff, size_t off)
 		return -1;
 
 	string_ex crc_cmd;
-	crc_cmd.format("UCmd: crc32 -v $loadaddr 0x%x %08x", min(m_each, fbuff->size()), crc);
+	crc_cmd.format("UCmd: crc32 -v $loadaddr 0x%x %08x", min(m_each, fbuff->size()), c.crc);
 
 	int ret = fb.Transport(crc_cmd, nullptr, 0);
 	if (ret)
@@ -1184,17 +2108,116 @@ int FBCRC::each(FastBoot& fb, std::shared_ptr<DataBuffer> fbuff, size_t off)
 	return ret;
 }
 
-int FBWrite::each(FastBoot& fb, std::shared_ptr<DataBuffer> fbuff, size_t off)
+int FBWrite::parser(char *p)
+{
+	if (FBLoop::parser(p))
+		return -1;
+
+	if (m_delta && (m_region == 0 || m_region % m_blksize))
+	{
+		set_last_err_string("-region must be a multiple of -blksz");
+		return -1;
+	}
+	return 0;
+}
+
+void FBWrite::prepare(Chunk &c)
+{
+	if (!m_delta)
+		return;
+
+	for (size_t pos = 0; pos < c.data->size(); pos += m_region)
+		c.crcs.push_back(crc32_fast(0, c.data->data() + pos, min(m_region, c.data->size() - pos)));
+}
+
+int FBWrite::write(FastBoot& fb, const uint8_t *data, size_t sz, size_t off)
 {
 	string_ex cmd;
-	cmd.format("download:%08x", fbuff->size());
+	cmd.format("download:%08x", sz);
 
-	if (fb.Transport(cmd, fbuff->data(), fbuff->size()))
+	if (fb.Transport(cmd, (void*)data, sz))
 		return -1;
 
-	string cmd_w = build_cmd(m_uboot_cmd, off / m_blksize, div_round_up(fbuff->size(), m_blksize));
+	string cmd_w = build_cmd(m_uboot_cmd, off / m_blksize, div_round_up(sz, m_blksize));
 	if (fb.Transport(cmd_w, nullptr, 0))
 		return -1;
 
 	return 0;
 }
+
+int FBWrite::compare(FastBoot& fb, uint32_t crc, size_t sz, size_t off)
+{
+	string cmd = build_cmd(m_read_cmd, off / m_blksize, div_round_up(sz, m_blksize));
+	if (fb.Transport(cmd, nullptr, 0))
+		return -1;
+
+	/* a mismatch is the expected answer for a changed region, don't report it */
+	string_ex crc_cmd;
+	crc_cmd.format("UCmd: crc32 -v $loadaddr 0x%x %08x", sz, crc);
+	fb.m_quiet = true;
+	int ret = fb.Transport(crc_cmd, nullptr, 0);
+	fb.m_quiet = false;
+	return ret ? 1 : 0;
+}
+
+int FBWrite::each(FastBoot& fb, const Chunk &c, size_t off)
+{
+	const shared_ptr<DataBuffer> &fbuff = c.data;
+	int &crc32_ok = fb.ctx()->m_fb_crc32;
+	if (!m_delta || !crc32_ok)
+		return write(fb, fbuff->data(), fbuff->size(), off);
+
+	/* read back each region and write the runs of changed ones only */
+	size_t start = 0;
+	size_t changed = 0;
+	for (size_t i = 0; i < c.crcs.size(); i++)
+	{
+		size_t pos = i * m_region;
+		size_t sz = min(m_region, fbuff->size() - pos);
+
+		int ret = compare(fb, c.crcs[i], sz, off + pos);
+		if (ret < 0)
+			return -1;
+
+		if (ret && crc32_ok < 0)
+		{
+			/* a failed crc32 -v only means "changed" if it passes on a region just written */
+			if (write(fb, fbuff->data() + pos, sz, off + pos))
+				return -1;
+
+			ret = compare(fb, c.crcs[i], sz, off + pos);
+			if (ret < 0)
+				return -1;
+
+			crc32_ok = !ret;
+			if (ret)
+			{
+				pos += sz;
+				if (pos < fbuff->size() && write(fb, fbuff->data() + pos, fbuff->size() - pos, off + pos))
+					return -1;
+
+				set_last_err_string("-delta: u-boot crc32 -v fails on written data, -delta turned off");
+				return -1;
+			}
+			continue;
+		}
+
+		if (ret)
+		{
+			if (!changed)
+				start = pos;
+			changed += sz;
+			continue;
+		}
+
+		crc32_ok = 1;
+		if (changed && write(fb, fbuff->data() + start, changed, off + start))
+			return -1;
+		changed = 0;
+	}
+
+	if (changed)
+		return write(fb, fbuff->data() + start, changed, off + start);
+
+	return 0;
+}
@@ -35,29 +35,61 @@
 #include "bmap.h"
 
 #include <cstdint>
+#include <functional>
 
 class FBFlashCmd;
 class FileBuffer;
 class DataBuffer;
 class TransBase;
+struct TransSegment;
 
 /*
 Android fastboot protocol define at
 https://android.googlesource.com/platform/system/core/+/master/fastboot/
 */
 
+/* receives the DATA phase of an upload, the transport reads into get() */
+class FBDataSink
+{
+public:
+	virtual ~FBDataSink() {}
+
+	/* sz bytes are announced by DATA */
+	virtual int begin(size_t sz) = 0;
+	/* room for the next read, sz is cut down to what fits */
+	virtual uint8_t *get(size_t &sz) = 0;
+	/* sz bytes were read into the last get() */
+	virtual int commit(size_t sz) = 0;
+};
+
 class FastBoot
 {
 public:
-	FastBoot(TransBase *p) : m_pTrans{p} {}
+	/* ctx, if given, has its cached getvar results dropped by commands that may change them */
+	FastBoot(TransBase *p, CmdCtx *ctx = nullptr) : m_pTrans{p}, m_ctx{ctx} {}
 
 	int Transport(std::string cmd, void *p = nullptr, size_t size = 0, std::vector<uint8_t> *input = nullptr);
 	int Transport(std::string cmd, std::vector<uint8_t> data, std::vector<uint8_t> *input = nullptr) { return Transport(cmd, data.data(), data.size(), input); }
+	/* send the pieces as one DATA phase */
+	int Transport(std::string cmd, const std::vector<TransSegment> &data, std::vector<uint8_t> *input = nullptr);
+	int Transport(std::string cmd, const std::vector<TransSegment> &data, FBDataSink *sink);
+	int Transport(std::string cmd, FBDataSink *sink) { return Transport(cmd, std::vector<TransSegment>(), sink); }
+	/* send sz bytes of p from offset, read window by window while sending */
+	int Transport(std::string cmd, std::shared_ptr<FileBuffer> p, size_t offset, size_t sz);
+
+	CmdCtx *ctx() const { return m_ctx; }
 
 	std::string m_info;
+	std::vector<std::string> m_info_lines;	/* each INFO response */
+	/* keep the device's answers to m_info, for probes which may FAIL */
+	bool m_quiet = false;
 
 private:
+	/* send(sz) writes the DATA phase of a download, sz is what the device asked for */
+	int exchange(std::string cmd, const std::function<int(size_t)> &send, FBDataSink *sink);
+
 	TransBase *const m_pTrans = nullptr;
+	CmdCtx *const m_ctx = nullptr;
 };
 
 class FBGetVar : public CmdBase
@@ -68,9 +100,13 @@ public:
 	int parser(char *p = nullptr) override;
 	int run(CmdCtx *ctx) override;
 
+	/* var of the device in ctx, asked only once per session */
+	static int get(CmdCtx *ctx, const std::string &var, std::string &val, bool quiet = false);
+
 private:
 	std::string m_val;
 	std::string m_var;
+	bool m_quiet = false;
 
 	friend FBFlashCmd;
 };
@@ -101,12 +137,22 @@ public:
 	size_t m_seek = 0;			//byte address
 	size_t m_skip = 0;			//byte address
 	bool m_nostop = false;
+	size_t m_prefetch = 0x4000000;	//bytes read ahead of the chunk being sent, at least one chunk
 
 	std::string m_filename;
 
+	struct Chunk
+	{
+		std::shared_ptr<DataBuffer> data;
+		uint32_t crc = 0;
+		std::vector<uint32_t> crcs;	//one for each region, FBWrite -delta
+	};
+
 	FBLoop(char* p);
 
-	virtual int each(FastBoot& fb, std::shared_ptr<DataBuffer> fbuff, size_t off) = 0;
+	/* called on the prefetch thread for each chunk, before each() */
+	virtual void prepare(Chunk &) {}
+	virtual int each(FastBoot& fb, const Chunk &c, size_t off) = 0;
 	int run(CmdCtx* ctx) override;
 	std::string build_cmd(std::string& cmd, size_t off, size_t sz);
 };
@@ -114,7 +160,8 @@ public:
 class FBCRC : public FBLoop
 {
 public:
-	int each(FastBoot& fb, std::shared_ptr<DataBuffer> fbuff, size_t off) override;
+	void prepare(Chunk &c) override;
+	int each(FastBoot& fb, const Chunk &c, size_t off) override;
 	FBCRC(char* p) : FBLoop(p) {
 		m_uboot_cmd = "mmc read $loadaddr @off @size";
 		insert_param_info("CRC", nullptr, Param::Type::e_null);
@@ -124,17 +171,45 @@ public:
 class FBWrite : public FBLoop
 {
 public:
-	int each(FastBoot& fb, std::shared_ptr<DataBuffer> fbuff, size_t off) override;
+	int parser(char *p = nullptr) override;
+	void prepare(Chunk &c) override;
+	int each(FastBoot& fb, const Chunk &c, size_t off) override;
 	FBWrite(char* p) : FBLoop(p) {
 		m_uboot_cmd = "mmc write ${fastboot_buffer} @off @size";
 		insert_param_info("WRITE", nullptr, Param::Type::e_null);
+		insert_param_info("-delta", &m_delta, Param::Type::e_bool);
+		insert_param_info("-region", &m_region, Param::Type::e_uint32);
+		insert_param_info("-readformat", &m_read_cmd, Param::Type::e_string);
 	};
+
+private:
+	int write(FastBoot& fb, const uint8_t *data, size_t sz, size_t off);
+	/* 0 if the sz bytes at off on the device have crc, 1 if not, -1 if they can't be read */
+	int compare(FastBoot& fb, uint32_t crc, size_t sz, size_t off);
+
+	/* -delta: skip the regions whose crc already matches on the device */
+	bool m_delta = false;
+	size_t m_region = 0x100000;	//byte address
+	std::string m_read_cmd = "mmc read $loadaddr @off @size";
 };
 
 class FBUCmd : public FBCmd
 {
 public:
 	FBUCmd(char *p) :FBCmd(p, "UCmd") {}
+
+	/*
+	 * Number of commands from begin that can be sent to u-boot joined as
+	 * "a && b && c", only plain env/mmc setup commands qualify. 0 if less
+	 * than two. run_batch() fails without sending them if u-boot has no
+	 * hush parser, which is asked once per session.
+	 */
+	static size_t batch_size(CmdList::const_iterator begin, CmdList::const_iterator end);
+	static int run_batch(CmdCtx *ctx, CmdList::const_iterator begin, size_t count);
+
+private:
+	bool batchable() const;
+	std::string env_name() const;
 };
 
 class FBACmd : public FBCmd
@@ -168,10 +243,11 @@ public:
 	int parser(char *p = nullptr) override;
 	int run(CmdCtx *ctx) override;
 	int flash(FastBoot *fb, void *p, size_t sz);
+	int flash(FastBoot *fb, const std::vector<TransSegment> &data);
+	int flash(FastBoot *fb, std::shared_ptr<FileBuffer> p, size_t offset, size_t sz);
 	int flash_raw2sparse(FastBoot *fb, std::shared_ptr<FileBuffer> p, size_t max);
 	bool isffu(std::shared_ptr<FileBuffer> p);
-	int flash_ffu(FastBoot *fb, std::shared_ptr<FileBuffer> p);
-	int flash_ffu_oneblk(FastBoot *fb, std::shared_ptr<FileBuffer> p, size_t off, size_t blksz, size_t blkindex);
+	int flash_ffu(FastBoot *fb, std::shared_ptr<FileBuffer> p, size_t max);
 
 private:
 	bmap_t m_bmap;
@@ -289,6 +365,7 @@ private:
 	bool m_bDownload;
 	std::string m_local_file;
 	size_t m_Maxsize_pre_cmd = 0x10000;
+	size_t m_Maxsize_limit = 0x1000000;
 	std::string m_target_file;
 };
 
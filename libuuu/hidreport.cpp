@@ -72,36 +72,58 @@ int HIDReport::write(const void *p, size_t sz, uint8_t report_id)
 	notify(sz, uuu_notify::NOTIFY_TRANS_SIZE);
 
 	const uint8_t * const buff = reinterpret_cast<const uint8_t *>(p);
-	size_t off = 0;
-	for (; off < sz; off += m_size_out)
+	const size_t stride = m_size_out + m_size_payload;
+
+	/*
+	 * Frame a batch of reports back to back so the transport can keep
+	 * several of them queued on the OUT endpoint, instead of waiting for
+	 * one round trip per report.
+	 */
+	for (size_t off = 0; off < sz;)
 	{
-		m_out_buff[0] = report_id;
+		size_t batch = sz - off;
+		if (batch > m_size_out * m_batch_reports)
+			batch = m_size_out * m_batch_reports;
 
-		size_t s = sz - off;
+		size_t count = (batch + m_size_out - 1) / m_size_out;
+		m_out_buff.resize(count * stride);
 
-		if (s > m_size_out)
-			s = m_size_out;
+		size_t total = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			uint8_t *report = m_out_buff.data() + i * stride;
+			report[0] = report_id;
+
+			size_t s = batch - i * m_size_out;
+
+			if (s > m_size_out)
+				s = m_size_out;
+
+			memcpy(report + m_size_payload, buff + off + i * m_size_out, s);
 
-		memcpy(m_out_buff.data() + m_size_payload, buff + off, s);
+			/*
+			 * The Windows HIDAPI is ver strict. It always require to send
+			 * buffers of the size reported by the HID Report Descriptor.
+			 * Therefore we must to send m_size_out buffers for HID ID 2
+			 * albeit it may not required for the last buffer.
+			 */
+			if (report_id == 2 && s < m_size_out)
+			{
+				memset(report + m_size_payload + s, 0, m_size_out - s);
+				s = m_size_out;
+			}
 
-		/*
-		 * The Windows HIDAPI is ver strict. It always require to send
-		 * buffers of the size reported by the HID Report Descriptor.
-		 * Therefore we must to send m_size_out buffers for HID ID 2
-		 * albeit it may not required for the last buffer.
-		 */
-		if (report_id == 2)
-			s = m_size_out;
+			total = i * stride + s + m_size_payload;
+		}
 
-		int ret = m_pdev->write(m_out_buff.data(), s + m_size_payload);
+		int ret = m_pdev->write_reports(m_out_buff.data(), total, stride);
 
 		if (ret < 0)
 			return -1;
 
-		if (off % 0x1F == 0)
-		{
-			notify(off, uuu_notify::NOTIFY_TRANS_POS);
-		}
+		off += batch;
+
+		notify(off, uuu_notify::NOTIFY_TRANS_POS);
 	}
 
 	notify(sz, uuu_notify::NOTIFY_TRANS_POS);
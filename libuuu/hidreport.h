@@ -63,6 +63,8 @@ public:
 	}
 
 private:
+	/* reports framed and queued at once, progress is notified per batch */
+	size_t m_batch_reports = 1024;
 	size_t m_notify_total = 0;
 	std::vector<uint8_t> m_out_buff;
 	TransBase * const m_pdev = nullptr;
@@ -63,6 +63,27 @@ EXT int uuu_get_version();
 
 
 
+/*
+ * USB transfer statistics of one device, accumulated over the session.
+ * A transfer is one read or write call of the protocol layer.
+ */
+struct uuu_usb_stats
+{
+	const char *path;		/* usb path of the device */
+	uint64_t transfers;
+	uint64_t bytes;
+	uint64_t busy_us;		/* total time spent inside transfers */
+	uint64_t p50_latency_us;
+	uint64_t p99_latency_us;
+	uint64_t max_latency_us;
+	double mbps;			/* sustained MB/s while transferring, bytes / busy_us */
+	uint64_t stalls;		/* endpoint stalled */
+	uint64_t timeouts;
+	uint64_t errors;		/* any other transfer error */
+	uint64_t waits;			/* reads waiting for the device to answer, not in the numbers above */
+	uint64_t wait_us;
+};
+
 struct uuu_notify
 {
 	enum NOTIFY_TYPE
@@ -92,6 +113,8 @@ struct uuu_notify
 		NOTIFY_THREAD_EXIT,
 
 		NOTIFY_DONE,
+
+		NOTIFY_USB_STATS,	/* stats of the device, sent when a command closes its usb transport */
 	};
 
 	NOTIFY_TYPE type;
@@ -103,6 +126,7 @@ struct uuu_notify
 		size_t index;
 		size_t total;
 		char *str;
+		struct uuu_usb_stats *stats;
 	};
 };
 
@@ -111,6 +135,11 @@ typedef int (*uuu_notify_fun)(struct uuu_notify, void *data);
 int uuu_register_notify_callback(uuu_notify_fun f, void *data);
 int uuu_unregister_notify_callback(uuu_notify_fun f);
 
+/* return -1 if no transfer happened on the device at path yet */
+int uuu_get_usb_stats(const char *path, struct uuu_usb_stats *stats);
+typedef int (*uuu_usb_stats_fun)(struct uuu_usb_stats *stats, void *data);
+int uuu_for_each_usb_stats(uuu_usb_stats_fun fn, void *data);
+
 typedef int(*uuu_show_cfg)(const char *pro, const char *chip, const char *comp, uint16_t vid, uint16_t pid, uint16_t bcdlow, uint16_t bcdhigh, void *p);
 int uuu_for_each_cfg(uuu_show_cfg fn, void *p);
 
@@ -133,6 +162,17 @@ int uuu_set_wait_timeout(int timeout_in_seconds);
 int uuu_set_wait_next_timeout(int timeout_in_seconds);
 /*Set usb device polling period */
 void uuu_set_poll_period(int period_in_milliseconds);
+/*Set number of usb bulk requests kept in flight, 1 means synchronous transfer */
+void uuu_set_urb_depth(int depth);
+/*Probe bulk request sizes on the first big downloads to each device and keep the fastest */
+void uuu_set_bulk_autotune(int enable);
+/*
+ * Number of bulk writes in flight on one usb bus when several boards share it.
+ * 0 measure the bus and pick it, <0 no limit
+ */
+void uuu_set_usb_bus_limit(int limit);
+/*Send runs of FB: ucmd setenv/mmc dev ... lines to u-boot as one command */
+void uuu_set_ucmd_batch(int enable);
 /*
  * bit 0:15 for libusb
  * bit 16:31 for uuu
@@ -144,6 +184,16 @@ void uuu_set_debug_level(uint32_t mask);
  */
 void uuu_set_small_mem(uint32_t val);
 
+struct uuu_buffer_pool_stats
+{
+	uint64_t hits;			/* allocations served by a recycled buffer */
+	uint64_t misses;		/* allocations that went to the heap */
+	uint64_t cached;		/* bytes kept for reuse */
+};
+void uuu_get_buffer_pool_stats(struct uuu_buffer_pool_stats *stats);
+/*Back pooled file buffers of 2M and more by transparent huge pages, linux only */
+void uuu_set_buffer_pool_hugepage(int enable);
+
 #define MAX_USER_LEN 128
 typedef int (*uuu_askpasswd)(char* prompt, char user[MAX_USER_LEN], char passwd[MAX_USER_LEN]);
 int uuu_set_askpasswd(uuu_askpasswd ask);
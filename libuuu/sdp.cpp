@@ -194,11 +194,11 @@ int SDPDcdCmd::run(CmdCtx*ctx)
 	m_spdcmd.m_addr = EndianSwap(m_dcd_addr ? m_dcd_addr : rom->free_addr);
 	m_spdcmd.m_count = EndianSwap(size);
 
-	HIDTrans dev(m_timeout);
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::hid, m_timeout);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	HIDReport report(&dev);
+	HIDReport report(dev.get());
 	if (report.write(&m_spdcmd, sizeof(m_spdcmd), 1))
 		return -1;
 
@@ -218,11 +218,11 @@ SDPSkipDCDCmd::SDPSkipDCDCmd(char *p) : SDPCmdBase(p)
 
 int SDPSkipDCDCmd::run(CmdCtx*ctx)
 {
-	HIDTrans dev(m_timeout);
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::hid, m_timeout);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	HIDReport report(&dev);
+	HIDReport report(dev.get());
 	if (report.write(&m_spdcmd, sizeof(m_spdcmd), 1))
 		return -1;
 
@@ -379,11 +379,11 @@ SDPStatusCmd::SDPStatusCmd(char *p) : SDPCmdBase(p)
 
 int SDPStatusCmd::run(CmdCtx *ctx)
 {
-	HIDTrans dev(m_timeout);
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::hid, m_timeout);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	HIDReport report(&dev);
+	HIDReport report(dev.get());
 	if (report.write(&m_spdcmd, sizeof(m_spdcmd), 1))
 		return -1;
 
@@ -555,11 +555,11 @@ int SDPWriteCmd::run(CmdCtx*ctx)
 
 int SDPWriteCmd::run(CmdCtx *ctx, void *pbuff, size_t size, uint32_t addr, bool validate)
 {
-	HIDTrans dev(m_timeout);
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::hid, m_timeout);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	HIDReport report(&dev);
+	HIDReport report(dev.get());
 
 	report.set_notify_total(size);
 
@@ -610,11 +610,11 @@ SDPReadMemCmd::SDPReadMemCmd(char *p) : SDPCmdBase(p)
 
 int SDPReadMemCmd::run(CmdCtx *ctx)
 {
-	HIDTrans dev(m_timeout);
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::hid, m_timeout);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	HIDReport report(&dev);
+	HIDReport report(dev.get());
 
 	printf("\nReading address 0x%08X ...\n", m_mem_addr);
 	m_spdcmd.m_addr = EndianSwap(m_mem_addr);
@@ -676,11 +676,11 @@ SDPWriteMemCmd::SDPWriteMemCmd(char *p) : SDPCmdBase(p)
 
 int SDPWriteMemCmd::run(CmdCtx *ctx)
 {
-	HIDTrans dev(m_timeout);
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::hid, m_timeout);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	HIDReport report(&dev);
+	HIDReport report(dev.get());
 
 	printf("\nWriting 0x%08X to address 0x%08X ...\n", m_mem_value, m_mem_addr);
 	m_spdcmd.m_addr = EndianSwap(m_mem_addr);
@@ -736,11 +736,11 @@ int SDPJumpCmd::run(CmdCtx *ctx)
 {
 	const ROM_INFO * rom = search_rom_info(ctx->m_config_item);
 
-	HIDTrans dev(m_timeout);
-	if (dev.open(ctx->m_dev))
+	auto dev = create_trans(TransType::hid, m_timeout);
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	HIDReport report(&dev);
+	HIDReport report(dev.get());
 
 	if (rom == nullptr)
 	{
@@ -833,12 +833,12 @@ SDPBootlogCmd::SDPBootlogCmd(char *p) : SDPCmdBase(p)
 
 int SDPBootlogCmd::run(CmdCtx *ctx)
 {
-	HIDTrans dev{2000};
+	auto dev = create_trans(TransType::hid, 2000);
 
-	if (dev.open(ctx->m_dev))
+	if (dev->open(ctx->m_dev))
 		return -1;
 
-	HIDReport report(&dev);
+	HIDReport report(dev.get());
 
 	vector<uint8_t> v(65);
 	v[0] = 'I';
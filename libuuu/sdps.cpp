@@ -104,11 +104,12 @@ int SDPSCmd::run(CmdCtx *pro)
 		return -1;
 	}
 
-	HIDTrans dev(m_timeout);
-	if (rom->flags & ROM_INFO_HID_EP1)
-		dev.set_hid_out_ep(1);
+	auto dev = create_trans(TransType::hid, m_timeout);
+	HIDTrans *hid = dynamic_cast<HIDTrans *>(dev.get());
+	if (hid && (rom->flags & ROM_INFO_HID_EP1))
+		hid->set_hid_out_ep(1);
 
-	if(dev.open(pro->m_dev))
+	if(dev->open(pro->m_dev))
 		return -1;
 
 	shared_ptr<FileBuffer> p1 = get_file_buffer(m_filename, true);
@@ -116,7 +117,7 @@ int SDPSCmd::run(CmdCtx *pro)
 		return -1;
 
 	shared_ptr<DataBuffer> p;
-	HIDReport report(&dev);
+	HIDReport report(dev.get());
 	report.set_skip_notify(false);
 
 	size_t offset = m_offset;
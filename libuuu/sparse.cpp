@@ -35,6 +35,113 @@
 #include <cstddef>
 #include <cstring>
 
+using namespace std;
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SPARSE_SSE2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SPARSE_AVX2_TARGET
+#else
+#define SPARSE_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+/*
+ * Constant block detection. All the versions compare the block against
+ * its first 32bit word and stop at the first difference; p is 4 bytes
+ * aligned and sz is a multiple of 4.
+ */
+static bool is_fill_scalar(const uint8_t *p, size_t sz, uint32_t val)
+{
+	uint64_t pattern = (uint64_t(val) << 32) | val;
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= sz; i += sizeof(uint64_t))
+	{
+		uint64_t v;
+		memcpy(&v, p + i, sizeof(v));
+		if (v != pattern)
+			return false;
+	}
+	for (; i < sz; i += sizeof(uint32_t))
+	{
+		uint32_t v;
+		memcpy(&v, p + i, sizeof(v));
+		if (v != val)
+			return false;
+	}
+	return true;
+}
+
+#ifdef SPARSE_SSE2
+static bool is_fill_sse2(const uint8_t *p, size_t sz, uint32_t val)
+{
+	const __m128i pattern = _mm_set1_epi32(val);
+	size_t i = 0;
+	for (; i + 64 <= sz; i += 64)
+	{
+		__m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p + i)), pattern);
+		__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p + i + 16)), pattern);
+		__m128i c = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)), pattern);
+		__m128i d = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p + i + 48)), pattern);
+		__m128i diff = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF)
+			return false;
+	}
+	return is_fill_scalar(p + i, sz - i, val);
+}
+
+SPARSE_AVX2_TARGET
+static bool is_fill_avx2(const uint8_t *p, size_t sz, uint32_t val)
+{
+	const __m256i pattern = _mm256_set1_epi32(val);
+	size_t i = 0;
+	for (; i + 128 <= sz; i += 128)
+	{
+		__m256i a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + i)), pattern);
+		__m256i b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + i + 32)), pattern);
+		__m256i c = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + i + 64)), pattern);
+		__m256i d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + i + 96)), pattern);
+		__m256i diff = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+		if (!_mm256_testz_si256(diff, diff))
+			return false;
+	}
+	return is_fill_sse2(p + i, sz - i, val);
+}
+
+static bool has_avx2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	/* OSXSAVE and AVX, and the OS saves the ymm registers */
+	if ((info[2] & (3 << 27)) != (3 << 27) || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+using IsFillFn = bool (*)(const uint8_t *p, size_t sz, uint32_t val);
+
+static IsFillFn select_is_fill()
+{
+#ifdef SPARSE_SSE2
+	return has_avx2() ? is_fill_avx2 : is_fill_sse2;
+#else
+	return is_fill_scalar;
+#endif
+}
+
+static const IsFillFn g_is_fill = select_is_fill();
+
 
 int SparseFile::init_header(size_t blsz, int blcount)
 {
@@ -50,15 +157,27 @@ int SparseFile::init_header(size_t blsz, int blcount)
 	m_cur_chunk_header_pos = 0;
 	if (blcount)
 	{
-		m_data.reserve(blsz*blcount + 0x1000);
 		m_max_size = blsz * blcount;
+		m_max_write_blks = blcount;
 	}
+	m_write_blks = 0;
 	m_data.clear();
+	m_pieces.clear();
+	m_owners.clear();
+	m_size = 0;
 	push(&header, sizeof(header));
-	m_pcrc = (uint32_t*)(m_data.data() + offsetof(sparse_header, image_checksum));
 	return 0;
 }
 
+vector<TransSegment> SparseFile::segments() const
+{
+	vector<TransSegment> segs;
+	segs.reserve(m_pieces.size());
+	for (auto &piece : m_pieces)
+		segs.push_back({ piece.ext ? piece.ext : m_data.data() + piece.off, piece.size });
+	return segs;
+}
+
 bool SparseFile::is_append_old_chuck(int type, void *p)
 {
 	chunk_header_t *pchunk;
@@ -82,12 +201,17 @@ bool SparseFile::is_append_old_chuck(int type, void *p)
 
 bool SparseFile::is_same_value(void *data, size_t sz)
 {
-	uint32_t *p = (uint32_t *)data;
-	uint32_t val = *p;
-	for (size_t i = 0; i < sz / sizeof(uint32_t); i++)
-		if (val != p[i])
-			return false;
-	return true;
+	uint32_t val;
+	return is_fill_block(data, sz, &val);
+}
+
+bool SparseFile::is_fill_block(const void *data, size_t sz, uint32_t *val)
+{
+	if (sz < sizeof(uint32_t))
+		return false;
+
+	memcpy(val, data, sizeof(uint32_t));
+	return g_is_fill((const uint8_t *)data, sz & ~(sizeof(uint32_t) - 1), *val);
 }
 
 bool SparseFile::is_validate_sparse_file(void *p, size_t)
@@ -103,10 +227,35 @@ int SparseFile::push(void *p, size_t sz)
 	size_t pos = m_data.size();
 	m_data.resize(pos + sz);
 	memcpy(m_data.data() + pos, p, sz);
+
+	if (!m_pieces.empty() && !m_pieces.back().ext && m_pieces.back().off + m_pieces.back().size == pos)
+		m_pieces.back().size += sz;
+	else
+		m_pieces.push_back({ nullptr, pos, sz });
+	m_size += sz;
 	return 0;
 }
 
-int SparseFile::push_one_block(void *data, bool skip)
+void SparseFile::push_ref(const void *p, size_t sz, const shared_ptr<void> &owner)
+{
+	if (!owner)
+	{
+		push((void *)p, sz);
+		return;
+	}
+
+	const uint8_t *data = (const uint8_t *)p;
+	if (!m_pieces.empty() && m_pieces.back().ext && m_pieces.back().ext + m_pieces.back().size == data)
+		m_pieces.back().size += sz;
+	else
+		m_pieces.push_back({ data, 0, sz });
+
+	if (m_owners.empty() || m_owners.back() != owner)
+		m_owners.push_back(owner);
+	m_size += sz;
+}
+
+int SparseFile::push_one_block(void *data, bool skip, const shared_ptr<void> &owner)
 {
 	chunk_header_t *pchunk;
 	pchunk = (chunk_header_t *)(m_data.data() + m_cur_chunk_header_pos);
@@ -118,6 +267,14 @@ int SparseFile::push_one_block(void *data, bool skip)
 
 	int type = skip ? CHUNK_TYPE_DONT_CARE : CHUNK_TYPE_RAW;
 
+	/* a block of one repeated word is sent as its value only */
+	uint32_t fill;
+	if (type == CHUNK_TYPE_RAW && is_fill_block(data, pheader->blk_sz, &fill))
+	{
+		type = CHUNK_TYPE_FILL;
+		data = &fill;
+	}
+
 	if (!is_append_old_chuck(type, data))
 	{
 		chunk_header_t header;
@@ -126,35 +283,48 @@ int SparseFile::push_one_block(void *data, bool skip)
 		header.total_sz = sizeof(chunk_header_t);
 		if (type == CHUNK_TYPE_RAW)
 			header.total_sz += pheader->blk_sz;
+		if (type == CHUNK_TYPE_FILL)
+			header.total_sz += sizeof(fill);
 		header.reserved1 = 0;
 
 		pheader->total_chunks++;
 
 		m_cur_chunk_header_pos = m_data.size();
 
+		size_t blk_sz = pheader->blk_sz;
 		push(&header, sizeof(chunk_header_t));
 
 		if (type == CHUNK_TYPE_RAW)
-			push(data, pheader->blk_sz);
+			push_ref(data, blk_sz, owner);
+		if (type == CHUNK_TYPE_FILL)
+			push(&fill, sizeof(fill));
 	}
 	else
 	{
 		pchunk->chunk_sz++;
 		if (type == CHUNK_TYPE_RAW)
 		{
-			push(data, pheader->blk_sz);
 			pchunk->total_sz += pheader->blk_sz;
+			push_ref(data, pheader->blk_sz, owner);
 		}
 	}
 
-	if (m_data.size() + 2 * pheader->blk_sz > m_max_size ) {
+	pheader = (sparse_header *)m_data.data();
+	if (m_size + 2 * pheader->blk_sz > m_max_size ) {
 		return -1;
 	}
 
+	/*
+	 * FILL blocks hardly take room here, but the device writes each of them
+	 * before it answers. Keep what it writes within the size of a raw image.
+	 */
+	if (type != CHUNK_TYPE_DONT_CARE && ++m_write_blks >= m_max_write_blks)
+		return -1;
+
 	return 0;
 }
 
-size_t SparseFile::push_one_chuck(chunk_header_t *p, void *data)
+size_t SparseFile::push_one_chuck(chunk_header_t *p, void *data, const shared_ptr<void> &owner)
 {
 	chunk_header_t cheader = *p;
 	sparse_header *pheader;
@@ -162,11 +332,11 @@ size_t SparseFile::push_one_chuck(chunk_header_t *p, void *data)
 
 	size_t sz = p->total_sz - sizeof(chunk_header);
 
-	if (p->total_sz + m_data.size() > m_max_size)
+	if (p->total_sz + m_size > m_max_size)
 	{
 		if (p->chunk_type == CHUNK_TYPE_RAW)
 		{
-			size_t blk = (m_max_size - m_data.size()) / pheader->blk_sz;
+			size_t blk = (m_max_size - m_size) / pheader->blk_sz;
 			if (blk < 2)
 				return 0;
 
@@ -180,18 +350,19 @@ size_t SparseFile::push_one_chuck(chunk_header_t *p, void *data)
 			return 0;
 	}
 
-	push(&cheader, sizeof(chunk_header));
 	pheader->total_chunks ++;
 	pheader->total_blks += cheader.chunk_sz;
+	m_cur_chunk_header_pos = m_data.size();
+	push(&cheader, sizeof(chunk_header));
 
 	if (data) {
-		push(data, sz);
+		push_ref(data, sz, owner);
 	}
 
 	return sz;
 }
 
-size_t SparseFile::push_raw_data(void *data, size_t sz)
+size_t SparseFile::push_raw_data(void *data, size_t sz, const shared_ptr<void> &owner)
 {
 	chunk_header_t cheader;
 	cheader.chunk_type = CHUNK_TYPE_RAW;
@@ -201,7 +372,6 @@ size_t SparseFile::push_raw_data(void *data, size_t sz)
 
 	cheader.chunk_sz = sz / pheader->blk_sz;
 	cheader.total_sz = cheader.chunk_sz*pheader->blk_sz + sizeof(chunk_header_t);
-	pheader = (sparse_header *)m_data.data();
 
-	return push_one_chuck(&cheader, data);
+	return push_one_chuck(&cheader, data, owner);
 }
@@ -31,13 +31,20 @@
 #pragma once
 
 #include "sparse_format.h"
+#include "trans.h"
 
 #include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <vector>
 
 class SparseFile
 {
 public:
+	/*
+	 * Headers and the payload pushed without an owner. Payload pushed with
+	 * an owner is only referenced, use segments() to send the whole image.
+	 */
 	std::vector<uint8_t> m_data;
 
 	static chunk_header_t * get_next_chunk(uint8_t *p, size_t &pos);
@@ -46,15 +53,37 @@ public:
 
 	bool is_append_old_chuck(int type, void *p);
 	bool is_same_value(void *data, size_t sz);
+	/* true if data is one 32bit value repeated, the value is returned in val */
+	static bool is_fill_block(const void *data, size_t sz, uint32_t *val);
 	static bool is_validate_sparse_file(void *p, size_t sz);
 
 	int push(void *p, size_t sz);
-	int push_one_block(void *data, bool skip=false);
-	size_t push_one_chuck(chunk_header_t *p, void *data);
-	size_t push_raw_data(void *data, size_t sz);
+	/* append without copy, owner keeps p valid until the image is sent; copy if owner is null */
+	void push_ref(const void *p, size_t sz, const std::shared_ptr<void> &owner);
+	/* return -1 once the image is full, the block is in it */
+	int push_one_block(void *data, bool skip = false, const std::shared_ptr<void> &owner = nullptr);
+	size_t push_one_chuck(chunk_header_t *p, void *data, const std::shared_ptr<void> &owner = nullptr);
+	size_t push_raw_data(void *data, size_t sz, const std::shared_ptr<void> &owner = nullptr);
+
+	/* size of the whole image */
+	size_t size() const noexcept { return m_size; }
+	std::vector<TransSegment> segments() const;
 
 private:
+	/* part of the image, at m_data + off if ext is null */
+	struct Piece
+	{
+		const uint8_t *ext;
+		size_t off;
+		size_t size;
+	};
+
 	size_t m_cur_chunk_header_pos;
 	size_t m_max_size;
-	uint32_t *m_pcrc;
+	size_t m_size = 0;
+	/* RAW and FILL blocks pushed by push_one_block(), the device writes each of them */
+	size_t m_write_blks = 0;
+	size_t m_max_write_blks = SIZE_MAX;
+	std::vector<Piece> m_pieces;
+	std::vector<std::shared_ptr<void>> m_owners;
 };
@@ -30,11 +30,20 @@
 */
 
 #include "trans.h"
+#include "bussched.h"
+#include "transstats.h"
+#include "libcomm.h"
 #include "libuuu.h"
 #include "liberror.h"
 #include "libusb.h"
 #include "zip.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <mutex>
+
 extern "C"
 {
 #include "libusb.h"
@@ -42,10 +51,245 @@ extern "C"
 
 using namespace std;
 
+static atomic<int> g_urb_depth{4};
+
+/* data one board sends before the next board on the same bus gets its turn */
+static const size_t g_bus_slice = 0x400000;
+
+void uuu_set_urb_depth(int depth)
+{
+	g_urb_depth = depth;
+}
+
+static unique_ptr<TransBase> create_usb_trans(TransType type, int timeout)
+{
+	if (type == TransType::hid)
+		return unique_ptr<TransBase>(new HIDTrans(timeout));
+
+	return unique_ptr<TransBase>(new BulkTrans(timeout));
+}
+
+static atomic<TransFactory> g_trans_factory{create_usb_trans};
+
+void set_trans_factory(TransFactory factory)
+{
+	g_trans_factory = factory ? factory : create_usb_trans;
+}
+
+unique_ptr<TransBase> create_trans(TransType type, int timeout)
+{
+	return g_trans_factory.load()(type, timeout);
+}
+
+/*
+ * Bulk request size tuning. The first big writes to a device are sent in
+ * slices, each slice with one of the candidate request sizes. Once all
+ * candidates are measured, the fastest one is used for this device for
+ * the rest of the session. Devices are told apart by vid/pid/usb path.
+ *
+ * The requests in flight are usbfs memory, which all devices share
+ * (usbcore.usbfs_memory_mb, 16M by default), so request * urb depth is
+ * kept within g_inflight_budget. A candidate that still gets
+ * LIBUSB_ERROR_NO_MEM is rejected together with the bigger ones.
+ */
+static const size_t g_tune_request[] = { 0x10000, 0x40000, 0x100000 };
+static const size_t g_tune_count = sizeof(g_tune_request) / sizeof(g_tune_request[0]);
+
+struct TuneResult
+{
+	double speed[g_tune_count] = {};
+	size_t next = 0;
+	size_t best = 0x100000;
+};
+
+static const size_t g_inflight_budget = 0x400000;
+
+static atomic<bool> g_tune{true};
+static mutex g_tune_mutex;
+static map<string, TuneResult> g_tune_result;
+
+void uuu_set_bulk_autotune(int enable)
+{
+	g_tune = enable != 0;
+}
+
+/* slice long enough to hide the cost of the first request */
+static size_t tune_slice(size_t request)
+{
+	return max<size_t>(request * 4, 0x100000);
+}
+
+/* biggest request which keeps the urbs in flight within g_inflight_budget */
+static size_t request_limit()
+{
+	size_t depth = max(g_urb_depth.load(), 1);
+	return max<size_t>(g_inflight_budget / depth / g_tune_request[0] * g_tune_request[0], g_tune_request[0]);
+}
+
+/* skip candidate r.next and the bigger ones, pick the fastest of those measured */
+static void tune_finish(TuneResult &r)
+{
+	while (r.next < g_tune_count)
+		r.speed[r.next++] = 0;
+
+	size_t best = 0;
+	for (size_t i = 1; i < g_tune_count; i++)
+		if (r.speed[i] > r.speed[best])
+			best = i;
+	r.best = g_tune_request[best];
+}
+
+/* return false if tuning is finished, request is the size to use from now on */
+static bool tune_next(const string &key, size_t remain, size_t &request, size_t &slice)
+{
+	lock_guard<mutex> lck(g_tune_mutex);
+	TuneResult &r = g_tune_result[key];
+
+	if (r.next < g_tune_count && g_tune_request[r.next] > request_limit())
+		tune_finish(r);
+
+	if (r.next >= g_tune_count)
+	{
+		request = r.best;
+		return false;
+	}
+
+	request = g_tune_request[r.next];
+	slice = tune_slice(request);
+	if (slice > remain)
+	{
+		/* try again with next big enough write */
+		request = r.best;
+		return false;
+	}
+	return true;
+}
+
+static void tune_update(const string &key, size_t request, size_t bytes, chrono::steady_clock::duration elapsed)
+{
+	lock_guard<mutex> lck(g_tune_mutex);
+	TuneResult &r = g_tune_result[key];
+
+	if (r.next >= g_tune_count || g_tune_request[r.next] != request)
+		return;
+
+	r.speed[r.next++] = bytes / chrono::duration<double>(elapsed).count();
+
+	if (r.next == g_tune_count)
+		tune_finish(r);
+}
+
+/* request got LIBUSB_ERROR_NO_MEM, return false if there is no smaller one to try */
+static bool tune_reject(const string &key, size_t request)
+{
+	lock_guard<mutex> lck(g_tune_mutex);
+	TuneResult &r = g_tune_result[key];
+
+	if (r.next >= g_tune_count || g_tune_request[r.next] != request || r.next == 0)
+		return false;
+
+	tune_finish(r);
+	return true;
+}
+
 TransBase::~TransBase()
 {
 }
 
+int TransBase::write_reports(void *buff, size_t size, size_t stride)
+{
+	uint8_t *p = (uint8_t *)buff;
+	for (size_t off = 0; off < size; off += stride)
+	{
+		size_t sz = size - off;
+		if (sz > stride)
+			sz = stride;
+
+		int ret = write(p + off, sz);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * writev() sends pieces of at least this size in place. It is a multiple of
+ * any usb max packet size, so only the last write of a stream can be short.
+ */
+static const size_t g_gather_align = 0x1000;
+static const size_t g_gather_size = 0x100000;
+
+uint8_t * TransBase::gather_buffer(size_t size)
+{
+	if (m_gather.size() < size)
+		m_gather.resize(size);
+	return m_gather.data();
+}
+
+int TransBase::writev(const vector<TransSegment> &segs)
+{
+	if (segs.size() == 1)
+		return write((void *)segs[0].data, segs[0].size);
+
+	lock_guard<mutex> lock(m_gather_lock);
+	uint8_t *bounce = gather_buffer(g_gather_size);
+	size_t used = 0;
+
+	for (auto &seg : segs)
+	{
+		const uint8_t *p = (const uint8_t *)seg.data;
+		size_t sz = seg.size;
+
+		while (sz)
+		{
+			if (sz >= g_gather_size)
+			{
+				/* pad what is gathered to the alignment with the head of this segment */
+				size_t head = (g_gather_align - used % g_gather_align) % g_gather_align;
+				memcpy(bounce + used, p, head);
+				used += head;
+				p += head;
+				sz -= head;
+
+				if (used)
+				{
+					int ret = write(bounce, used);
+					if (ret < 0)
+						return ret;
+					used = 0;
+				}
+
+				size_t direct = sz / g_gather_align * g_gather_align;
+				int ret = write((void *)p, direct);
+				if (ret < 0)
+					return ret;
+				p += direct;
+				sz -= direct;
+				continue;
+			}
+
+			size_t n = min(sz, g_gather_size - used);
+			memcpy(bounce + used, p, n);
+			used += n;
+			p += n;
+			sz -= n;
+
+			if (used == g_gather_size)
+			{
+				int ret = write(bounce, used);
+				if (ret < 0)
+					return ret;
+				used = 0;
+			}
+		}
+	}
+
+	if (used)
+		return write(bounce, used);
+
+	return 0;
+}
+
 int TransBase::read(vector<uint8_t> &buff)
 {
 	size_t size;
@@ -56,13 +300,21 @@ int TransBase::read(vector<uint8_t> &buff)
 	return ret;
 }
 
-int USBTrans::open(void *p)
+USBSession::~USBSession()
 {
-	m_devhandle = p;
+	if (m_devhandle)
+		libusb_close((libusb_device_handle *)m_devhandle);
+}
+
+int USBSession::claim()
+{
+	if (m_claimed)
+		return 0;
+
 	libusb_device_handle * handle = (libusb_device_handle *)m_devhandle;
 	if (libusb_kernel_driver_active(handle, 0))
 	{
-		int ret = libusb_detach_kernel_driver((libusb_device_handle *)m_devhandle, 0);
+		int ret = libusb_detach_kernel_driver(handle, 0);
 		if(ret <0 && ret != LIBUSB_ERROR_NOT_SUPPORTED)
 		{
 			set_last_err_string("detach kernel driver failure");
@@ -76,8 +328,9 @@ int USBTrans::open(void *p)
 		return -1;
 	}
 
+	libusb_device *dev = libusb_get_device(handle);
 	libusb_config_descriptor *config;
-	if (libusb_get_active_config_descriptor(libusb_get_device(handle), &config))
+	if (libusb_get_active_config_descriptor(dev, &config))
 	{
 		set_last_err_string("Can't get config descriptor");
 		return -1;
@@ -92,6 +345,32 @@ int USBTrans::open(void *p)
 
 	libusb_free_config_descriptor(config);
 
+	string path = get_device_path(dev);
+	libusb_device_descriptor desc;
+	if (libusb_get_device_descriptor(dev, &desc) == 0)
+	{
+		string_ex id;
+		id.format("%04x:%04x@%s", desc.idVendor, desc.idProduct, path.c_str());
+		m_id = id;
+	}
+
+	m_stats = get_trans_stats(path);
+	m_bus = get_bus_scheduler(path);
+	m_claimed = true;
+	return 0;
+}
+
+int USBTrans::open(void *p)
+{
+	m_session = static_cast<USBSession *>(p);
+	if (m_session->claim())
+		return -1;
+
+	m_devhandle = m_session->handle();
+	m_EPs = m_session->endpoints();
+	m_stats = m_session->stats();
+	m_stats_mark = m_stats->transfers();
+
 	return 0;
 }
 
@@ -100,9 +379,22 @@ int USBTrans::close()
 	/* needn't clean resource here
 	   libusb_close will release all resource when finish running cmd
 	*/
+	if (m_stats && m_stats->transfers() != m_stats_mark)
+	{
+		notify_trans_stats(*m_stats);
+		m_stats_mark = m_stats->transfers();
+	}
 	return 0;
 }
 
+HIDTrans::~HIDTrans()
+{
+	m_urbs.reset();
+	if (m_devhandle)
+		close();
+	m_devhandle = nullptr;
+}
+
 int HIDTrans::open(void *p)
 {
 	if (USBTrans::open(p))
@@ -122,6 +414,7 @@ int HIDTrans::write(void *buff, size_t size)
 	int ret;
 	uint8_t *p = (uint8_t *)buff;
 	int actual_size;
+	auto start = chrono::steady_clock::now();
 
 	if (m_outEP)
 	{
@@ -148,6 +441,8 @@ int HIDTrans::write(void *buff, size_t size)
 		);
 	}
 
+	m_stats->record(size, chrono::steady_clock::now() - start, ret);
+
 	if (ret < 0)
 	{
 		string err;
@@ -160,10 +455,36 @@ int HIDTrans::write(void *buff, size_t size)
 	return ret;
 }
 
+int HIDTrans::write_reports(void *buff, size_t size, size_t stride)
+{
+	/* SET_REPORT over ep0 can't be queued, only the interrupt out endpoint */
+	if (!m_outEP || g_urb_depth <= 1 || size <= stride)
+		return TransBase::write_reports(buff, size, stride);
+
+	if (!m_urbs)
+	{
+		m_urbs.reset(new LibusbURBQueue(m_devhandle, m_outEP, LIBUSB_TRANSFER_TYPE_INTERRUPT, m_timeout, g_urb_depth));
+		m_urbs->set_stats(m_stats);
+	}
+
+	int ret = m_urbs->write((uint8_t *)buff, size, stride);
+	if (ret < 0)
+	{
+		string err;
+		err = "HID(W):";
+		err += libusb_error_name(ret);
+		set_last_err_string(err);
+		return ret;
+	}
+
+	return 0;
+}
+
 int HIDTrans::read(void *buff, size_t size, size_t *rsize)
 {
 	int ret;
-	int actual;
+	int actual = 0;
+	auto start = chrono::steady_clock::now();
 	ret = libusb_interrupt_transfer(
 		(libusb_device_handle *)m_devhandle,
 		0x81,
@@ -172,6 +493,7 @@ int HIDTrans::read(void *buff, size_t size, size_t *rsize)
 		&actual,
 		m_timeout
 	);
+	m_stats->record(actual, chrono::steady_clock::now() - start, ret);
 
 	*rsize = actual;
 
@@ -188,37 +510,183 @@ int HIDTrans::read(void *buff, size_t size, size_t *rsize)
 	return 0;
 }
 
-int BulkTrans::write(void *buff, size_t size)
+BulkTrans::~BulkTrans()
+{
+	m_urbs.reset();
+	if (m_gather_dma)
+		free_dma(m_gather_dma, m_gather_dma_size);
+	m_gather_dma = nullptr;
+	if (m_devhandle)
+		close();
+	m_devhandle = nullptr;
+}
+
+/*
+ * usbfs memory is shared by every device (usbcore.usbfs_memory_mb, 16M by
+ * default) and the in flight URBs need it too, so each transport keeps to
+ * a small part of it and falls back to heap beyond.
+ */
+static const size_t g_dma_budget = 0x200000;
+
+void * BulkTrans::alloc_dma(size_t size)
+{
+	void *p = nullptr;
+#if LIBUSB_API_VERSION >= 0x01000105 && !defined(FORCE_OLDLIBUSB)
+	/* usbfs zero copy buffer, limited by usbcore.usbfs_memory_mb */
+	lock_guard<mutex> lck(m_dma_lock);
+	if (m_devhandle && m_dma_size + size <= g_dma_budget)
+		p = libusb_dev_mem_alloc((libusb_device_handle *)m_devhandle, size);
+	if (p)
+	{
+		m_dma.push_back(p);
+		m_dma_size += size;
+	}
+#else
+	(void)size;
+#endif
+	return p;
+}
+
+bool BulkTrans::free_dma(void *p, size_t size)
+{
+	lock_guard<mutex> lck(m_dma_lock);
+	auto it = find(m_dma.begin(), m_dma.end(), p);
+	if (it == m_dma.end())
+		return false;
+
+	m_dma.erase(it);
+	m_dma_size -= size;
+#if LIBUSB_API_VERSION >= 0x01000105 && !defined(FORCE_OLDLIBUSB)
+	libusb_dev_mem_free((libusb_device_handle *)m_devhandle, (unsigned char *)p, size);
+#else
+	(void)size;
+#endif
+	return true;
+}
+
+uint8_t * BulkTrans::gather_buffer(size_t size)
+{
+	/* try usbfs memory once, so the gathered data is not copied by the kernel again */
+	if (!m_gather_tried)
+	{
+		m_gather_tried = true;
+		m_gather_dma = alloc_dma(size);
+		if (m_gather_dma)
+			m_gather_dma_size = size;
+	}
+
+	if (m_gather_dma && m_gather_dma_size >= size)
+		return (uint8_t *)m_gather_dma;
+
+	return TransBase::gather_buffer(size);
+}
+
+int BulkTrans::write_requests(uint8_t *p, size_t size, size_t request, size_t &sent)
 {
 	int ret = 0;
 	int actual_length;
-	for (size_t i = 0; i < size; i += m_MaxTransPreRequest)
+
+	sent = 0;
+
+	/* Keep several requests in flight so the bus is not idle between two of them */
+	bool async = size > request && g_urb_depth > 1;
+	if (async)
+	{
+		if (!m_urbs)
+		{
+			m_urbs.reset(new LibusbURBQueue(m_devhandle, m_ep_out.addr, LIBUSB_TRANSFER_TYPE_BULK, m_timeout, g_urb_depth));
+			m_urbs->set_stats(m_stats);
+		}
+
+		ret = m_urbs->write(p, size, request, &sent);
+		if (ret < 0)
+			return ret;
+	}
+
+	for (size_t i = 0; i < size && !async; i += request)
 	{
-		uint8_t *p = (uint8_t *)buff;
-		p += i;
 		size_t sz;
 		sz = size - i;
-		if (sz > m_MaxTransPreRequest)
-			sz = m_MaxTransPreRequest;
+		if (sz > request)
+			sz = request;
 
+		auto start = chrono::steady_clock::now();
 		ret = libusb_bulk_transfer(
 			(libusb_device_handle *)m_devhandle,
 			m_ep_out.addr,
-			p,
+			p + i,
 			sz,
 			&actual_length,
 			m_timeout
 		);
+		m_stats->record(sz, chrono::steady_clock::now() - start, ret);
 
 		if (ret < 0)
-		{
-			string error;
-			string err;
-			err = "Bulk(W):";
-			err += libusb_error_name(ret);
-			set_last_err_string(err);
 			return ret;
+		sent += sz;
+	}
+
+	return ret;
+}
+
+static int bulk_write_error(int ret)
+{
+	string err;
+	err = "Bulk(W):";
+	err += libusb_error_name(ret);
+	set_last_err_string(err);
+	return ret;
+}
+
+int BulkTrans::write(void *buff, size_t size)
+{
+	int ret = 0;
+	int actual_length;
+	uint8_t *p = (uint8_t *)buff;
+	size_t off = 0;
+
+	while (!m_tune_key.empty() && off < size)
+	{
+		size_t request, slice;
+		if (!tune_next(m_tune_key, size - off, request, slice))
+		{
+			m_MaxTransPreRequest = request;
+			break;
+		}
+
+		BusScheduler::Slot slot(m_session->bus(), slice);
+		auto start = chrono::steady_clock::now();
+		size_t sent;
+		ret = write_requests(p + off, slice, request, sent);
+		if (ret == LIBUSB_ERROR_NO_MEM && tune_reject(m_tune_key, request))
+		{
+			/* what was sent is on the device, go on with a smaller request */
+			off += sent;
+			continue;
 		}
+		if (ret < 0)
+			return bulk_write_error(ret);
+
+		tune_update(m_tune_key, request, slice, chrono::steady_clock::now() - start);
+		off += slice;
+	}
+
+	size_t request = min(m_MaxTransPreRequest, request_limit());
+
+	/*
+	 * take turns with the other boards on the bus slice by slice. Commands
+	 * and other writes of one request don't hold up anybody, they go at once.
+	 */
+	BusScheduler *bus = size > request ? m_session->bus() : nullptr;
+	while (off < size)
+	{
+		size_t slice = min(size - off, max(g_bus_slice, request));
+		BusScheduler::Slot slot(bus, slice);
+		size_t sent;
+		ret = write_requests(p + off, slice, request, sent);
+		if (ret < 0)
+			return bulk_write_error(ret);
+		off += slice;
 	}
 
 	//Send zero package
@@ -262,12 +730,15 @@ int BulkTrans::open(void *p)
 				m_ep_out = m_EPs[i];
 		}
 	}
+
+	if (g_tune)
+		m_tune_key = m_session->id();
 	return 0;
 }
 int BulkTrans::read(void *buff, size_t size, size_t *rsize)
 {
 	int ret;
-	int actual_length;
+	int actual_length = 0;
 	uint8_t *p = (uint8_t *)buff;
 
 	if (size == 0)
@@ -276,6 +747,7 @@ int BulkTrans::read(void *buff, size_t size, size_t *rsize)
 		return 0;
 	}
 
+	auto start = chrono::steady_clock::now();
 	ret = libusb_bulk_transfer(
 		(libusb_device_handle *)m_devhandle,
 		m_ep_in.addr,
@@ -285,6 +757,12 @@ int BulkTrans::read(void *buff, size_t size, size_t *rsize)
 		m_timeout
 	);
 
+	/* asking for up to one packet is waiting for the device's answer, such as OKAY */
+	if (size <= (size_t)m_ep_in.package_size)
+		m_stats->record_wait(chrono::steady_clock::now() - start, ret);
+	else
+		m_stats->record(actual_length, chrono::steady_clock::now() - start, ret);
+
 	*rsize = actual_length;
 
 	if (ret < 0)
@@ -30,10 +30,25 @@
 */
 #pragma once
 
+#include "urb.h"
+
 #include <atomic>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
+struct libusb_device;
+class BusScheduler;
+class TransStats;
+
+/* one piece of a stream sent by TransBase::writev() */
+struct TransSegment
+{
+	const void *data;
+	size_t size;
+};
+
 class TransBase
 {
 public:
@@ -46,11 +61,32 @@ public:
 	virtual int close() { return 0; }
 	virtual int write(void *buff, size_t size) = 0;
 	virtual int read(void *buff, size_t size, size_t *return_size) = 0;
+	/* send buff as back to back reports of stride bytes, the last one may be shorter */
+	virtual int write_reports(void *buff, size_t size, size_t stride);
+	/*
+	 * send the segments as one stream, as if they were one buffer. Big segments
+	 * are sent in place, small ones are gathered so no write ends in a short packet
+	 * before the end of the stream.
+	 */
+	virtual int writev(const std::vector<TransSegment> &segs);
+	/* memory the transport can send without an extra copy, nullptr if not supported */
+	virtual void * alloc_dma(size_t /*size*/) { return nullptr; }
+	/* return false if p was not allocated by alloc_dma() */
+	virtual bool free_dma(void * /*p*/, size_t /*size*/) { return false; }
 	int write(std::vector<uint8_t> & buff) { return write(buff.data(), buff.size()); }
 	int read(std::vector<uint8_t> &buff);
 
 protected:
+	/*
+	 * writev() gathers small segments here. The buffer is allocated on first
+	 * use and kept for the life of the transport; m_gather_lock is held while
+	 * it is filled and sent.
+	 */
+	virtual uint8_t * gather_buffer(size_t size);
+
 	void * m_devhandle = nullptr;
+	std::mutex m_gather_lock;
+	std::vector<uint8_t> m_gather;
 };
 
 class EPInfo
@@ -62,48 +98,116 @@ public:
 	int package_size = 64;
 };
 
+/*
+ * An opened usb device. The interface is claimed and the endpoints are
+ * read only once; the transport of each command borrows the session.
+ * CmdUsbCtx owns it and CmdCtx::m_dev points to it.
+ */
+class USBSession
+{
+public:
+	USBSession(void *devhandle) : m_devhandle{devhandle} {}
+	USBSession(const USBSession&) = delete;
+	USBSession& operator=(const USBSession&) = delete;
+	~USBSession();
+
+	int claim();
+	void * handle() const noexcept { return m_devhandle; }
+	const std::vector<EPInfo> & endpoints() const noexcept { return m_EPs; }
+	/* vid:pid@usb path */
+	const std::string & id() const noexcept { return m_id; }
+	const std::shared_ptr<TransStats> & stats() const noexcept { return m_stats; }
+	BusScheduler * bus() const noexcept { return m_bus.get(); }
+
+private:
+	void * const m_devhandle = nullptr;
+	bool m_claimed = false;
+	std::vector<EPInfo> m_EPs;
+	std::string m_id;
+	std::shared_ptr<TransStats> m_stats;
+	std::shared_ptr<BusScheduler> m_bus;
+};
+
 class USBTrans : public TransBase
 {
 public:
+	/* p is the USBSession of the device */
 	int open(void *p) override;
 	int close() override;
 
 protected:
+	USBSession *m_session = nullptr;
 	std::vector<EPInfo> m_EPs;
+	std::shared_ptr<TransStats> m_stats;
+	uint64_t m_stats_mark = 0;
 };
 class HIDTrans : public USBTrans
 {
 public:
 	HIDTrans(int timeout = 1000) : m_timeout{timeout} {}
-	~HIDTrans() override { if (m_devhandle) close();  m_devhandle = nullptr; }
+	~HIDTrans() override;
 
 	int open(void *p) override;
 	void set_hid_out_ep(int ep) noexcept { m_outEP = ep; }
 	int write(void *buff, size_t size) override;
+	int write_reports(void *buff, size_t size, size_t stride) override;
 	int read(void *buff, size_t size, size_t *return_size) override;
 
 private:
 	int m_outEP = 0;
 	const int m_timeout = 1000;
 	int m_set_report = 9;
+	std::unique_ptr<URBQueue> m_urbs;
 };
 
 class BulkTrans : public USBTrans
 {
 public:
 	BulkTrans(int timeout = 2000) : m_timeout{timeout} {}
-	~BulkTrans() override { if (m_devhandle) close();  m_devhandle = nullptr; }
+	~BulkTrans() override;
 
 	int open(void *p) override;
 	int write(void *buff, size_t size) override;
 	int read(void *buff, size_t size, size_t *return_size) override;
+	void * alloc_dma(size_t size) override;
+	bool free_dma(void *p, size_t size) override;
+
+protected:
+	uint8_t * gather_buffer(size_t size) override;
 
 private:
+	/* sent is the data written before an error */
+	int write_requests(uint8_t *p, size_t size, size_t request, size_t &sent);
+
 	size_t m_MaxTransPreRequest = 0x100000;
+	std::string m_tune_key;
 	int m_b_send_zero = 0;
 	EPInfo m_ep_in;
 	EPInfo m_ep_out;
 	int m_timeout = 2000;
+	std::unique_ptr<URBQueue> m_urbs;
+	std::mutex m_dma_lock;	/* m_dma and m_dma_size, alloc_dma() may be called from any thread */
+	std::vector<void *> m_dma;
+	size_t m_dma_size = 0;
+	void *m_gather_dma = nullptr;
+	size_t m_gather_dma_size = 0;
+	bool m_gather_tried = false;
 };
 
+enum class TransType
+{
+	bulk,
+	hid,
+};
+
+/*
+ * Protocol commands get their transport from here instead of creating
+ * BulkTrans/HIDTrans directly, so the USB stack can be swapped out, e.g.
+ * by the device emulator for benchmarking.
+ */
+using TransFactory = std::unique_ptr<TransBase> (*)(TransType type, int timeout);
+void set_trans_factory(TransFactory factory);
+std::unique_ptr<TransBase> create_trans(TransType type, int timeout);
+
 int polling_usb(std::atomic<int>& bexit);
+std::string get_device_path(libusb_device *dev);
@@ -0,0 +1,212 @@
+/*
+ * Copyright 2026 NXP.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * Neither the name of the NXP Semiconductor nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "transstats.h"
+#include "libcomm.h"
+#include "libusb.h"
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+static mutex g_stats_mutex;
+static map<string, shared_ptr<TransStats>> g_stats;
+
+LatencyHistogram::LatencyHistogram()
+{
+	for (auto &c : m_count)
+		c = 0;
+}
+
+int LatencyHistogram::index(uint64_t us)
+{
+	if (us < (1u << m_sub_bits))
+		return (int)us;
+
+	int msb = 63;
+	while (!(us >> msb))
+		msb--;
+
+	int sub = (us >> (msb - m_sub_bits)) & ((1 << m_sub_bits) - 1);
+	return ((msb - m_sub_bits + 1) << m_sub_bits) + sub;
+}
+
+/* middle of the bucket */
+uint64_t LatencyHistogram::value(int index)
+{
+	if (index < (1 << m_sub_bits))
+		return index;
+
+	int msb = (index >> m_sub_bits) + m_sub_bits - 1;
+	uint64_t sub = index & ((1 << m_sub_bits) - 1);
+	uint64_t low = (1ull << msb) | (sub << (msb - m_sub_bits));
+	return low + (1ull << (msb - m_sub_bits)) / 2;
+}
+
+void LatencyHistogram::add(uint64_t us)
+{
+	m_count[index(us)].fetch_add(1, memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+	uint64_t count[m_buckets];
+	uint64_t total = 0;
+	for (int i = 0; i < m_buckets; i++)
+		total += count[i] = m_count[i].load(memory_order_relaxed);
+
+	if (total == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t)(total * p / 100);
+	if (rank >= total)
+		rank = total - 1;
+
+	for (int i = 0; i < m_buckets; i++)
+	{
+		if (rank < count[i])
+			return value(i);
+		rank -= count[i];
+	}
+	return value(m_buckets - 1);
+}
+
+void TransStats::record(size_t bytes, chrono::steady_clock::duration elapsed, int ret)
+{
+	uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(elapsed).count();
+	uint64_t us = ns / 1000;
+
+	m_transfers.fetch_add(1, memory_order_relaxed);
+	m_busy_ns.fetch_add(ns, memory_order_relaxed);
+	m_latency.add(us);
+
+	uint64_t max = m_max_us.load(memory_order_relaxed);
+	while (us > max && !m_max_us.compare_exchange_weak(max, us, memory_order_relaxed))
+		;
+
+	if (ret >= 0)
+		m_bytes.fetch_add(bytes, memory_order_relaxed);
+	else
+		record_error(ret);
+}
+
+void TransStats::record_wait(chrono::steady_clock::duration elapsed, int ret)
+{
+	m_waits.fetch_add(1, memory_order_relaxed);
+	m_wait_ns.fetch_add(chrono::duration_cast<chrono::nanoseconds>(elapsed).count(), memory_order_relaxed);
+
+	if (ret < 0)
+		record_error(ret);
+}
+
+void TransStats::record_error(int ret)
+{
+	if (ret == LIBUSB_ERROR_PIPE)
+		m_stalls.fetch_add(1, memory_order_relaxed);
+	else if (ret == LIBUSB_ERROR_TIMEOUT)
+		m_timeouts.fetch_add(1, memory_order_relaxed);
+	else
+		m_errors.fetch_add(1, memory_order_relaxed);
+}
+
+void TransStats::get(uuu_usb_stats &stats) const
+{
+	stats.path = m_path.c_str();
+	stats.transfers = m_transfers;
+	stats.waits = m_waits;
+	stats.wait_us = m_wait_ns / 1000;
+	stats.bytes = m_bytes;
+	stats.busy_us = m_busy_ns / 1000;
+	stats.p50_latency_us = m_latency.percentile(50);
+	stats.p99_latency_us = m_latency.percentile(99);
+	stats.max_latency_us = m_max_us;
+	stats.mbps = stats.busy_us ? (double)stats.bytes / stats.busy_us : 0;
+	stats.stalls = m_stalls;
+	stats.timeouts = m_timeouts;
+	stats.errors = m_errors;
+}
+
+shared_ptr<TransStats> get_trans_stats(const string &path)
+{
+	lock_guard<mutex> lck(g_stats_mutex);
+
+	auto &p = g_stats[path];
+	if (!p)
+		p = make_shared<TransStats>(path);
+	return p;
+}
+
+void notify_trans_stats(const TransStats &stats)
+{
+	uuu_usb_stats s;
+	stats.get(s);
+
+	uuu_notify nt;
+	nt.type = uuu_notify::NOTIFY_USB_STATS;
+	nt.stats = &s;
+	call_notify(nt);
+}
+
+int uuu_get_usb_stats(const char *path, struct uuu_usb_stats *stats)
+{
+	shared_ptr<TransStats> p;
+	{
+		lock_guard<mutex> lck(g_stats_mutex);
+		auto it = g_stats.find(path);
+		if (it == g_stats.end())
+			return -1;
+		p = it->second;
+	}
+
+	p->get(*stats);
+	return 0;
+}
+
+int uuu_for_each_usb_stats(uuu_usb_stats_fun fn, void *data)
+{
+	vector<shared_ptr<TransStats>> all;
+	{
+		lock_guard<mutex> lck(g_stats_mutex);
+		for (const auto &it : g_stats)
+			all.push_back(it.second);
+	}
+
+	for (const auto &p : all)
+	{
+		uuu_usb_stats s;
+		p->get(s);
+		if (fn(&s, data))
+			return -1;
+	}
+	return 0;
+}
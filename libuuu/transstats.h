@@ -0,0 +1,92 @@
+/*
+ * Copyright 2026 NXP.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * Neither the name of the NXP Semiconductor nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#pragma once
+
+#include "libuuu.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+
+/*
+ * Latency histogram without locks. Each power of two of microseconds is
+ * split into 4 linear sub buckets, so a percentile is accurate to 25%.
+ */
+class LatencyHistogram
+{
+public:
+	LatencyHistogram();
+
+	void add(uint64_t us);
+	uint64_t percentile(double p) const;
+
+private:
+	static constexpr int m_sub_bits = 2;
+	static constexpr int m_buckets = (64 - m_sub_bits + 1) << m_sub_bits;
+
+	static int index(uint64_t us);
+	static uint64_t value(int index);
+
+	std::atomic<uint64_t> m_count[m_buckets];
+};
+
+/* Transfer statistics of one usb device (path), shared by all its transports */
+class TransStats
+{
+public:
+	TransStats(const std::string &path) : m_path{path} {}
+
+	void record(size_t bytes, std::chrono::steady_clock::duration elapsed, int ret);
+	/* a read waiting for the device to answer, not counted in throughput and latency */
+	void record_wait(std::chrono::steady_clock::duration elapsed, int ret);
+	void get(uuu_usb_stats &stats) const;
+	uint64_t transfers() const noexcept { return m_transfers + m_waits; }
+
+private:
+	void record_error(int ret);
+
+	const std::string m_path;
+	LatencyHistogram m_latency;
+	std::atomic<uint64_t> m_transfers{0};
+	std::atomic<uint64_t> m_bytes{0};
+	std::atomic<uint64_t> m_busy_ns{0};
+	std::atomic<uint64_t> m_max_us{0};
+	std::atomic<uint64_t> m_waits{0};
+	std::atomic<uint64_t> m_wait_ns{0};
+	std::atomic<uint64_t> m_stalls{0};
+	std::atomic<uint64_t> m_timeouts{0};
+	std::atomic<uint64_t> m_errors{0};
+};
+
+std::shared_ptr<TransStats> get_trans_stats(const std::string &path);
+void notify_trans_stats(const TransStats &stats);
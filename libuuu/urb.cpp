@@ -0,0 +1,330 @@
+/*
+ * Copyright 2026 NXP.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * Neither the name of the NXP Semiconductor nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "urb.h"
+#include "transstats.h"
+
+#include <chrono>
+
+extern "C"
+{
+#include "libusb.h"
+}
+
+using namespace std;
+
+URBQueue::~URBQueue()
+{
+	stop();
+}
+
+int URBQueue::write(uint8_t *p, size_t size, size_t chunk, size_t *sent)
+{
+	unique_lock<mutex> lck(m_mutex);
+
+	if (!m_thread.joinable())
+		m_thread = thread(&URBQueue::completion_thread, this);
+
+	m_status = 0;
+	m_last_done = chrono::steady_clock::now();
+
+	size_t off = 0;
+	while (off < size)
+	{
+		m_slot_cv.wait(lck, [this] { return m_inflight < m_busy.size() || m_status; });
+		if (m_status)
+			break;
+
+		size_t slot = 0;
+		while (m_busy[slot])
+			slot++;
+
+		size_t sz = size - off;
+		if (sz > chunk)
+			sz = chunk;
+
+		m_busy[slot] = true;
+		m_start[slot] = chrono::steady_clock::now();
+		m_inflight++;
+
+		lck.unlock();
+		int ret = submit(slot, p + off, sz);
+		lck.lock();
+
+		if (ret == LIBUSB_ERROR_NO_MEM && m_inflight > 1 && !m_status)
+		{
+			/* usbfs memory is short, wait until a request in flight returns its part */
+			m_busy[slot] = false;
+			size_t inflight = --m_inflight;
+			m_slot_cv.wait(lck, [&] { return m_inflight < inflight || m_status; });
+			continue;
+		}
+
+		if (ret < 0)
+		{
+			m_busy[slot] = false;
+			m_inflight--;
+			if (!m_status)
+				m_status = ret;
+			break;
+		}
+
+		m_event_cv.notify_one();
+		off += sz;
+	}
+
+	if (m_status)
+	{
+		/* Stop the remaining requests, every one of them still completes */
+		vector<size_t> pending;
+		for (size_t i = 0; i < m_busy.size(); i++)
+			if (m_busy[i])
+				pending.push_back(i);
+
+		lck.unlock();
+		for (auto slot : pending)
+			cancel(slot);
+		lck.lock();
+	}
+
+	m_slot_cv.wait(lck, [this] { return m_inflight == 0; });
+
+	if (sent)
+		*sent = off;
+	return m_status;
+}
+
+void URBQueue::complete(size_t slot, int status, size_t actual)
+{
+	lock_guard<mutex> lck(m_mutex);
+
+	/* the requests before this one had the bus until they completed */
+	auto now = chrono::steady_clock::now();
+	auto begin = max(m_start[slot], m_last_done);
+	m_last_done = now;
+	if (m_stats && status != LIBUSB_ERROR_INTERRUPTED)
+		m_stats->record(actual, now - begin, status);
+
+	if (status < 0 && !m_status)
+		m_status = status;
+
+	m_busy[slot] = false;
+	m_inflight--;
+	m_slot_cv.notify_all();
+}
+
+void URBQueue::stop()
+{
+	{
+		lock_guard<mutex> lck(m_mutex);
+		m_exit = true;
+	}
+	m_event_cv.notify_all();
+
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void URBQueue::completion_thread()
+{
+	unique_lock<mutex> lck(m_mutex);
+
+	while (!m_exit)
+	{
+		if (!m_inflight)
+		{
+			m_event_cv.wait(lck);
+			continue;
+		}
+
+		lck.unlock();
+		handle_events(100);
+		lck.lock();
+	}
+}
+
+LibusbURBQueue::LibusbURBQueue(void *devhandle, int ep, int type, int timeout, size_t depth) :
+	URBQueue(depth), m_devhandle{devhandle}, m_ep{ep}, m_type{type}, m_timeout{timeout}
+{
+	for (size_t i = 0; i < this->depth(); i++)
+		m_transfers.push_back(libusb_alloc_transfer(0));
+}
+
+LibusbURBQueue::~LibusbURBQueue()
+{
+	stop();
+
+	for (auto t : m_transfers)
+		libusb_free_transfer(t);
+}
+
+void LibusbURBQueue::transfer_callback(libusb_transfer *transfer)
+{
+	LibusbURBQueue *q = (LibusbURBQueue *)transfer->user_data;
+
+	size_t slot = 0;
+	while (q->m_transfers[slot] != transfer)
+		slot++;
+
+	int status;
+	switch (transfer->status)
+	{
+	case LIBUSB_TRANSFER_COMPLETED:
+		status = 0;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		status = LIBUSB_ERROR_TIMEOUT;
+		break;
+	case LIBUSB_TRANSFER_STALL:
+		status = LIBUSB_ERROR_PIPE;
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		status = LIBUSB_ERROR_NO_DEVICE;
+		break;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		status = LIBUSB_ERROR_OVERFLOW;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		status = LIBUSB_ERROR_INTERRUPTED;
+		break;
+	default:
+		status = LIBUSB_ERROR_IO;
+		break;
+	}
+
+	q->complete(slot, status, transfer->actual_length);
+}
+
+int LibusbURBQueue::submit(size_t slot, uint8_t *p, size_t size)
+{
+	libusb_transfer *t = m_transfers[slot];
+	if (t == nullptr)
+		return LIBUSB_ERROR_NO_MEM;
+
+	if (m_type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		libusb_fill_interrupt_transfer(t, (libusb_device_handle *)m_devhandle, m_ep, p, size,
+			transfer_callback, this, m_timeout);
+	else
+		libusb_fill_bulk_transfer(t, (libusb_device_handle *)m_devhandle, m_ep, p, size,
+			transfer_callback, this, m_timeout);
+
+	return libusb_submit_transfer(t);
+}
+
+int LibusbURBQueue::cancel(size_t slot)
+{
+	return libusb_cancel_transfer(m_transfers[slot]);
+}
+
+int LibusbURBQueue::handle_events(int timeout_ms)
+{
+	struct timeval tv;
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+	return libusb_handle_events_timeout_completed(nullptr, &tv, nullptr);
+}
+
+SoftURBQueue::~SoftURBQueue()
+{
+	stop();
+}
+
+int SoftURBQueue::submit(size_t slot, uint8_t *p, size_t size)
+{
+	lock_guard<mutex> lck(m_soft_mutex);
+
+	if (m_pending.size() >= m_mem_limit)
+		return LIBUSB_ERROR_NO_MEM;
+
+	if (m_submitted++ == m_fail_submit)
+		return LIBUSB_ERROR_IO;
+
+	m_pending.push_back({ slot, m_submitted - 1, p, size, false });
+	if (m_pending.size() > m_max_inflight)
+		m_max_inflight = m_pending.size();
+
+	m_soft_cv.notify_all();
+	return 0;
+}
+
+int SoftURBQueue::cancel(size_t slot)
+{
+	lock_guard<mutex> lck(m_soft_mutex);
+
+	for (auto &r : m_pending)
+	{
+		if (r.slot == slot && !r.cancelled)
+		{
+			r.cancelled = true;
+			m_cancelled++;
+			return 0;
+		}
+	}
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int SoftURBQueue::handle_events(int timeout_ms)
+{
+	Request r;
+	{
+		unique_lock<mutex> lck(m_soft_mutex);
+		if (!m_soft_cv.wait_for(lck, chrono::milliseconds(timeout_ms), [this] { return !m_pending.empty(); }))
+			return LIBUSB_ERROR_TIMEOUT;
+		r = m_pending.front();
+	}
+
+	if (m_delay_us && !r.cancelled)
+		this_thread::sleep_for(chrono::microseconds(m_delay_us));
+
+	int status = 0;
+	size_t actual = 0;
+	{
+		lock_guard<mutex> lck(m_soft_mutex);
+
+		/* cancel() may have come in while sleeping */
+		bool cancelled = m_pending.front().cancelled;
+		m_pending.pop_front();
+
+		if (cancelled)
+			status = LIBUSB_ERROR_INTERRUPTED;
+		else if (r.seq == m_fail_complete)
+			status = LIBUSB_ERROR_IO;
+		else
+		{
+			m_data.insert(m_data.end(), r.p, r.p + r.size);
+			actual = r.size;
+		}
+	}
+
+	complete(r.slot, status, actual);
+	return 0;
+}
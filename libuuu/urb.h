@@ -0,0 +1,161 @@
+/*
+ * Copyright 2026 NXP.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice, this
+ * list of conditions and the following disclaimer in the documentation and/or
+ * other materials provided with the distribution.
+ *
+ * Neither the name of the NXP Semiconductor nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct libusb_transfer;
+class TransStats;
+
+/*
+ * Keep several USB requests (URB) in flight on one endpoint.
+ *
+ * write() splits the data into requests, submits up to depth() of them and
+ * waits until all finished. If submit() runs out of memory while other
+ * requests are in flight, it waits for one of them and tries again.
+ *
+ * A dedicated completion thread calls handle_events(); the implementation
+ * reports each submitted request back through complete() exactly once,
+ * from any thread. Each request is recorded in the stats on its own, timed
+ * from when the bus could start on it.
+ *
+ * Derived classes must call stop() in their destructor, before the objects
+ * used by handle_events() are destroyed.
+ */
+class URBQueue
+{
+public:
+	URBQueue(size_t depth) : m_busy(depth ? depth : 1), m_start(m_busy.size()) {}
+	URBQueue(const URBQueue&) = delete;
+	URBQueue& operator=(const URBQueue&) = delete;
+	virtual ~URBQueue();
+
+	size_t depth() const noexcept { return m_busy.size(); }
+	void set_stats(const std::shared_ptr<TransStats> &stats) { m_stats = stats; }
+	/* sent, if not null, is the data submitted; all of it was sent if submit() failed */
+	int write(uint8_t *p, size_t size, size_t chunk, size_t *sent = nullptr);
+
+protected:
+	/* return 0 if request queued, otherwise negative libusb error code */
+	virtual int submit(size_t slot, uint8_t *p, size_t size) = 0;
+	virtual int cancel(size_t slot) = 0;
+	virtual int handle_events(int timeout_ms) = 0;
+
+	void complete(size_t slot, int status, size_t actual);
+	void stop();
+
+private:
+	void completion_thread();
+
+	std::vector<bool> m_busy;
+	std::vector<std::chrono::steady_clock::time_point> m_start;
+	std::chrono::steady_clock::time_point m_last_done;
+	std::shared_ptr<TransStats> m_stats;
+	size_t m_inflight = 0;
+	int m_status = 0;
+	bool m_exit = false;
+	std::mutex m_mutex;
+	std::condition_variable m_slot_cv;
+	std::condition_variable m_event_cv;
+	std::thread m_thread;
+};
+
+class LibusbURBQueue : public URBQueue
+{
+public:
+	LibusbURBQueue(void *devhandle, int ep, int type, int timeout, size_t depth);
+	~LibusbURBQueue() override;
+
+protected:
+	int submit(size_t slot, uint8_t *p, size_t size) override;
+	int cancel(size_t slot) override;
+	int handle_events(int timeout_ms) override;
+
+private:
+	static void transfer_callback(libusb_transfer *transfer);
+
+	void * const m_devhandle = nullptr;
+	const int m_ep = 0;
+	const int m_type = 0;
+	const int m_timeout = 2000;
+	std::vector<libusb_transfer *> m_transfers;
+};
+
+/*
+ * Software stand-in for the USB stack, to check URBQueue without hardware.
+ * Requests complete in submission order on the completion thread, each after
+ * m_delay_us, and their data is appended to m_data.
+ */
+class SoftURBQueue : public URBQueue
+{
+public:
+	SoftURBQueue(size_t depth, unsigned int delay_us = 0) : URBQueue(depth), m_delay_us{delay_us} {}
+	~SoftURBQueue() override;
+
+	/* n-th submit (from 0) fails with LIBUSB_ERROR_IO, SIZE_MAX never */
+	size_t m_fail_submit = SIZE_MAX;
+	/* n-th request completes with LIBUSB_ERROR_IO */
+	size_t m_fail_complete = SIZE_MAX;
+	/* submit fails with LIBUSB_ERROR_NO_MEM while this many requests are in flight */
+	size_t m_mem_limit = SIZE_MAX;
+
+	std::vector<uint8_t> m_data;
+	size_t m_submitted = 0;
+	size_t m_cancelled = 0;
+	size_t m_max_inflight = 0;
+
+protected:
+	int submit(size_t slot, uint8_t *p, size_t size) override;
+	int cancel(size_t slot) override;
+	int handle_events(int timeout_ms) override;
+
+private:
+	struct Request
+	{
+		size_t slot;
+		size_t seq;
+		uint8_t *p;
+		size_t size;
+		bool cancelled;
+	};
+
+	const unsigned int m_delay_us;
+	std::deque<Request> m_pending;
+	std::mutex m_soft_mutex;
+	std::condition_variable m_soft_cv;
+};
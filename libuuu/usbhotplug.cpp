@@ -30,8 +30,9 @@
 */
 
 /*
- * Windows libusb don't support hotplug yet
- * Will polling devices list every 100ms
+ * Use libusb hotplug callbacks when the platform supports them.
+ * Windows libusb don't support hotplug yet, so fall back to polling
+ * the devices list every g_usb_poll_period.
  */
 
 #include <thread>
@@ -40,10 +41,13 @@
 #include <utility>
 #include <algorithm>
 #include <stdexcept>
+#include <unordered_set>
+#include <deque>
 #include "libusb.h"
 #include "liberror.h"
 #include "config.h"
 #include "cmd.h"
+#include "trans.h"
 #include "libcomm.h"
 #include "libuuu.h"
 #include "vector"
@@ -186,7 +190,7 @@ struct Timer
 #define TRY_SUDO ",Try sudo uuu"
 #endif
 
-static string get_device_path(libusb_device *dev)
+string get_device_path(libusb_device *dev)
 {
 	uint8_t path[8];
 
@@ -274,13 +278,15 @@ static int run_usb_cmds(ConfigItem *item, libusb_device *dev, short bcddevice)
 	ctx.m_config_item = item;
 	ctx.m_current_bcd = bcddevice;
 
-	if ((ret = open_libusb(dev, &(ctx.m_dev))))
+	void *handle;
+	if ((ret = open_libusb(dev, &handle)))
 	{
 		nt.type = uuu_notify::NOTIFY_CMD_END;
 		nt.status = -1;
 		call_notify(nt);
 		return ret;
 	}
+	ctx.open_session(handle);
 
 	ret = run_cmds(item->m_protocol.c_str(), &ctx);
 	g_known_device_state = KnownDeviceDone;
@@ -344,32 +350,57 @@ void compare_list(libusb_device ** old, libusb_device **nw)
 		return;
 	}
 
+	unordered_set<libusb_device *> oldset;
+	while ((dev = old[i++]) != nullptr)
+		oldset.insert(dev);
+
+	i = 0;
 	while ((dev = nw[i++]) != nullptr)
 	{
-		libusb_device * p;
-		int j = 0;
-		while ((p = old[j++]) != nullptr)
-		{
-			if (p == dev)
-				break;//find it.
-		};
-		if (p != dev)
+		if (!oldset.erase(dev))
 			usb_add(dev);
 	}
 
-	i = 0;
-	while ((dev = old[i++]) != nullptr)
+	/* whatever is left in oldset is gone */
+	for (auto p : oldset)
+		usb_remove(p);
+}
+
+/*
+ * libusb calls the hotplug callback from whichever thread handles events,
+ * which may be a transfer running in run_usb_cmds. Only queue the device
+ * there, polling_usb() pick it up and call usb_add().
+ */
+static struct {
+	deque<libusb_device *> list;
+	mutex lock;
+
+	void push_back(libusb_device *dev)
+	{
+		lock_guard<mutex> guard{lock};
+		list.push_back(libusb_ref_device(dev));
+	}
+
+	void drain()
 	{
-		libusb_device * p;
-		int j = 0;
-		while ((p = nw[j++]) != nullptr)
+		deque<libusb_device *> devs;
 		{
-			if (p == dev)
-				break;//find it.
-		};
-		if (p != dev)
-			usb_remove(dev);
+			lock_guard<mutex> guard{lock};
+			swap(devs, list);
+		}
+		for (auto dev : devs)
+		{
+			usb_add(dev);
+			libusb_unref_device(dev);
+		}
 	}
+} g_arrived_usb;
+
+static int LIBUSB_CALL usb_hotplug_arrived(libusb_context * /*ctx*/, libusb_device *dev,
+					   libusb_hotplug_event /*event*/, void * /*user_data*/)
+{
+	g_arrived_usb.push_back(dev);
+	return 0;
 }
 
 static int check_usb_timeout(Timer& usb_timer)
@@ -404,6 +435,32 @@ static int check_usb_timeout(Timer& usb_timer)
 	return 0;
 }
 
+static int hotplug_usb(std::atomic<int>& bexit, Timer &usb_timer, libusb_hotplug_callback_handle handle)
+{
+	int ret = 0;
+
+	while (!bexit)
+	{
+		g_arrived_usb.drain();
+
+		if (check_usb_timeout(usb_timer))
+		{
+			ret = -1;
+			break;
+		}
+
+		auto period = chrono::duration_cast<chrono::microseconds>(g_usb_poll_period.load());
+		timeval tv;
+		tv.tv_sec = static_cast<long>(period.count() / 1000000);
+		tv.tv_usec = static_cast<long>(period.count() % 1000000);
+		libusb_handle_events_timeout_completed(nullptr, &tv, nullptr);
+	}
+
+	libusb_hotplug_deregister_callback(nullptr, handle);
+	g_arrived_usb.drain();
+	return ret;
+}
+
 int polling_usb(std::atomic<int>& bexit)
 {
 	if (run_cmds("CFG:", nullptr))
@@ -411,6 +468,16 @@ int polling_usb(std::atomic<int>& bexit)
 
 	Timer usb_timer;
 
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+	{
+		libusb_hotplug_callback_handle handle;
+		if (libusb_hotplug_register_callback(nullptr, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+						     LIBUSB_HOTPLUG_ENUMERATE,
+						     LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+						     usb_hotplug_arrived, nullptr, &handle) == LIBUSB_SUCCESS)
+			return hotplug_usb(bexit, usb_timer, handle);
+	}
+
 	CAutoList oldlist(nullptr);
 
 	while(!bexit)
@@ -436,11 +503,14 @@ int polling_usb(std::atomic<int>& bexit)
 
 CmdUsbCtx::~CmdUsbCtx()
 {
-	if (m_dev)
-	{
-		libusb_close((libusb_device_handle*)m_dev);
-		m_dev = 0;
-	}
+	m_session.reset();
+	m_dev = nullptr;
+}
+
+void CmdUsbCtx::open_session(void *devhandle)
+{
+	m_session.reset(new USBSession(devhandle));
+	m_dev = m_session.get();
 }
 
 int CmdUsbCtx::look_for_match_device(const char *pro)
@@ -483,8 +553,10 @@ int CmdUsbCtx::look_for_match_device(const char *pro)
 					m_current_bcd = desc.bcdDevice;
 
 					int ret;
-					if ((ret = open_libusb(dev, &(m_dev))))
+					void *handle;
+					if ((ret = open_libusb(dev, &handle)))
 						return ret;
+					open_session(handle);
 
 					nt.str = (char*)str.c_str();
 					call_notify(nt);
@@ -226,7 +226,7 @@ int	Zip_file_Info::decompress(Zip *pZip, shared_ptr<FileBuffer>p)
 {
 	p->resize(m_filesize);
 	atomic_fetch_or(&p->m_dataflags, FILEBUFFER_FLAG_KNOWN_SIZE);
-	p->m_request_cv.notify_all();
+	p->notify_request();
 	
 	uuu_notify ut;
 	ut.type = uuu_notify::NOTIFY_DECOMPRESS_SIZE;
@@ -251,7 +251,7 @@ int	Zip_file_Info::decompress(Zip *pZip, shared_ptr<FileBuffer>p)
 	{
 		p->ref_other_buffer(zipfile, m_offset + off, m_filesize);
 		atomic_fetch_or(&p->m_dataflags, FILEBUFFER_FLAG_LOADED);
-		p->m_request_cv.notify_all();
+		p->notify_request();
 		return 0;
 	}
 
@@ -298,7 +298,7 @@ int	Zip_file_Info::decompress(Zip *pZip, shared_ptr<FileBuffer>p)
 		size_t have = each_out_size - m_strm.avail_out;
 
 		p->m_available_size = pos;
-		p->m_request_cv.notify_all();
+		p->notify_request();
 
 		pos += have;
 
@@ -324,7 +324,7 @@ int	Zip_file_Info::decompress(Zip *pZip, shared_ptr<FileBuffer>p)
 
 	p->m_available_size = m_filesize;
 	atomic_fetch_or(&p->m_dataflags, FILEBUFFER_FLAG_LOADED);
-	p->m_request_cv.notify_all();
+	p->notify_request();
 
 	ut.type = uuu_notify::NOTIFY_DECOMPRESS_POS;
 	ut.index = m_filesize;
@@ -193,6 +193,10 @@ void print_help(bool detail = false)
 		"    -T          Timeout second for wait next known usb device appeared at stage switch\n"
 		"    -e          set environment variable key=value\n"
 		"    -pp         usb polling period in milliseconds\n"
+		"    -urb        number of usb bulk requests kept in flight, 1 disables async transfer\n"
+		"    -notune     use fixed 1M usb bulk request size, don't probe for the fastest one\n"
+		"    -bus        max bulk writes in flight on one usb bus, 0 measure it (default), -1 no limit\n"
+		"    -batchucmd  send adjacent FB: ucmd setenv/mmc dev lines to u-boot in one command\n"
 		"    -dm         disable small memory\n"
 		"uuu -s          Enter shell mode. uuu.inputlog record all input commands\n"
 		"                you can use \"uuu uuu.inputlog\" next time to run all commands\n\n"
@@ -406,6 +410,10 @@ public:
 			m_cmd_index = nt.index;
 			return false;
 		}
+		if (nt.type == uuu_notify::NOTIFY_USB_STATS)
+		{
+			return g_verbose != 0;
+		}
 		if (nt.type == uuu_notify::NOTIFY_DONE)
 		{
 			if (m_status)
@@ -493,6 +501,23 @@ public:
 		if (nt->type == uuu_notify::NOTIFY_DOWNLOAD_START)
 			cout << "Download file:" << nt->str << endl;
 
+		if (nt->type == uuu_notify::NOTIFY_USB_STATS)
+		{
+			string_ex str;
+			str.format("%s>usb latency p50 %lluus p99 %lluus max %lluus, %.2f MB/s, device wait %llu %lluus, stall %llu timeout %llu error %llu",
+				m_dev.c_str(),
+				(unsigned long long)nt->stats->p50_latency_us,
+				(unsigned long long)nt->stats->p99_latency_us,
+				(unsigned long long)nt->stats->max_latency_us,
+				nt->stats->mbps,
+				(unsigned long long)nt->stats->waits,
+				(unsigned long long)nt->stats->wait_us,
+				(unsigned long long)nt->stats->stalls,
+				(unsigned long long)nt->stats->timeouts,
+				(unsigned long long)nt->stats->errors);
+			cout << str << endl;
+		}
+
 	}
 	void print(int verbose = 0, uuu_notify*nt=NULL)
 	{
@@ -994,6 +1019,24 @@ int main(int argc, char **argv)
 				i++;
 				uuu_set_poll_period(atoll(argv[i]));
 			}
+			else if (s == "-urb")
+			{
+				i++;
+				uuu_set_urb_depth(atoll(argv[i]));
+			}
+			else if (s == "-notune")
+			{
+				uuu_set_bulk_autotune(0);
+			}
+			else if (s == "-bus")
+			{
+				i++;
+				uuu_set_usb_bus_limit(atoll(argv[i]));
+			}
+			else if (s == "-batchucmd")
+			{
+				uuu_set_ucmd_batch(1);
+			}
 			else if (s == "-lsusb")
 			{
 				print_lsusb();